@@ -0,0 +1,361 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "crt-expr.hpp"
+#include "crt-context.hpp"
+#include "crt-algorithm.hpp"
+#include "crt-native.hpp"
+#include "crt-parallel.hpp"
+#include "crt-workers.hpp"
+
+
+
+
+/**
+ * Benchmarks for the core operations, on reproducible synthetic graphs. Each
+ * result is printed as one JSON object per line, for example
+ *
+ *     {"benchmark":"resolve_full","graph":"chain","size":1000,"seconds":0.0021,"per_second":476190}
+ *
+ * where seconds is the best of the repeated runs. Usage:
+ *
+ *     bench [--max-size N] [--repeat R] [--filter substring]
+ *
+ * Graph sizes go from 1000 up to max-size (default 100000) by factors of
+ * ten. resolve_native repeats resolve_full with the sum function registered
+ * through crt::native. Repeated context::insert is quadratic in the graph
+ * size, so it is only measured up to 10000 rules.
+ */
+
+
+
+
+//=============================================================================
+struct options_t
+{
+    std::size_t max_size = 100000;
+    int repeat = 3;
+    std::string filter;
+};
+
+static std::atomic<std::size_t> sink(0);
+
+
+
+
+//=============================================================================
+static crt::expression sum(crt::expression e)
+{
+    int total = 0;
+
+    for (const auto& part : e)
+    {
+        total += part->get_i32();
+    }
+    return total;
+}
+
+/**
+ * The same function as sum, for the 1 to 3 argument calls in the graphs
+ * below, registered through crt::native.
+ */
+static crt::func_t native_sum()
+{
+    return crt::overloaded(
+        crt::native<int(int)>([] (int a) { return a; }),
+        crt::native<int(int, int)>([] (int a, int b) { return a + b; }),
+        crt::native<int(int, int, int)>([] (int a, int b, int c) { return a + b + c; }));
+}
+
+static std::string node(std::size_t i)
+{
+    return "x" + std::to_string(i);
+}
+
+static crt::expression call_sum(std::vector<crt::expression> args)
+{
+    auto parts = crt::cont_t().transient();
+    parts.push_back(crt::symbol("sum"));
+
+    for (auto& a : args)
+    {
+        parts.push_back(std::move(a));
+    }
+    return parts.persistent();
+}
+
+
+/**
+ * x0 = 1, and x(i) = (sum x(i-1) 1).
+ */
+static std::vector<crt::expression> make_chain(std::size_t n)
+{
+    auto rules = std::vector<crt::expression>{crt::expression(1).keyed(node(0))};
+
+    for (std::size_t i = 1; i < n; ++i)
+    {
+        rules.push_back(call_sum({crt::symbol(node(i - 1)), 1}).keyed(node(i)));
+    }
+    return rules;
+}
+
+
+/**
+ * x0 = 1, and every other rule is (sum x0 i).
+ */
+static std::vector<crt::expression> make_fan_out(std::size_t n)
+{
+    auto rules = std::vector<crt::expression>{crt::expression(1).keyed(node(0))};
+
+    for (std::size_t i = 1; i < n; ++i)
+    {
+        rules.push_back(call_sum({crt::symbol(node(0)), int(i)}).keyed(node(i)));
+    }
+    return rules;
+}
+
+
+/**
+ * Stacked diamonds: each layer has a left and right rule referencing the
+ * previous layer, and a join referencing both.
+ */
+static std::vector<crt::expression> make_diamonds(std::size_t n)
+{
+    auto rules = std::vector<crt::expression>{crt::expression(1).keyed("x0")};
+
+    for (std::size_t i = 1; 3 * i - 2 < n; ++i)
+    {
+        auto prev = crt::symbol(node(i - 1));
+        auto l = "l" + std::to_string(i);
+        auto r = "r" + std::to_string(i);
+        rules.push_back(call_sum({prev, 1}).keyed(l));
+        rules.push_back(call_sum({prev, 2}).keyed(r));
+        rules.push_back(call_sum({crt::symbol(l), crt::symbol(r)}).keyed(node(i)));
+    }
+    return rules;
+}
+
+
+/**
+ * Each rule references up to three rules chosen at random from the ones
+ * before it. The generator is seeded, and its raw output is used directly,
+ * so the graph is the same on every platform.
+ */
+static std::vector<crt::expression> make_random(std::size_t n)
+{
+    auto rng = std::mt19937(12345);
+    auto rules = std::vector<crt::expression>{crt::expression(1).keyed(node(0))};
+
+    for (std::size_t i = 1; i < n; ++i)
+    {
+        auto args = std::vector<crt::expression>();
+        auto k = 1 + rng() % 3;
+
+        for (std::size_t j = 0; j < k; ++j)
+        {
+            args.push_back(crt::symbol(node(rng() % i)));
+        }
+        rules.push_back(call_sum(args).keyed(node(i)));
+    }
+    return rules;
+}
+
+
+
+
+//=============================================================================
+template<typename Fn>
+static double best_of(int repeat, Fn fn)
+{
+    auto best = 0.0;
+
+    for (int i = 0; i < repeat; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = i == 0 ? t : std::min(best, t);
+    }
+    return best;
+}
+
+template<typename Fn>
+static void run(const options_t& opts, const char* benchmark, const char* graph, std::size_t size, Fn fn)
+{
+    auto name = std::string(benchmark) + "/" + graph + "/" + std::to_string(size);
+
+    if (! opts.filter.empty() && name.find(opts.filter) == std::string::npos)
+    {
+        return;
+    }
+
+    auto seconds = best_of(opts.repeat, fn);
+
+    std::cout
+    << "{\"benchmark\":\"" << benchmark << "\""
+    << ",\"graph\":\"" << graph << "\""
+    << ",\"size\":" << size
+    << ",\"seconds\":" << seconds
+    << ",\"per_second\":" << (seconds > 0 ? double(size) / seconds : 0.0)
+    << "}" << std::endl;
+}
+
+
+
+
+//=============================================================================
+static void bench_graph(const options_t& opts, const char* graph, std::vector<crt::expression> rules)
+{
+    auto n = rules.size();
+    auto funcs = crt::context().insert(crt::expression(crt::func_t(sum)).keyed("sum"));
+    auto natives = crt::context().insert(crt::expression(native_sum()).keyed("sum"));
+    auto b = crt::context::builder();
+
+    for (const auto& e : rules)
+    {
+        b.insert(e);
+    }
+    auto ctx = b.build();
+    auto source = ctx.expr().unparse();
+
+    if (n <= 10000)
+    {
+        run(opts, "context_insert", graph, n, [&rules]
+        {
+            auto c = crt::context();
+
+            for (const auto& e : rules)
+            {
+                c = std::move(c).insert(e);
+            }
+            sink += c.size();
+        });
+    }
+
+    run(opts, "context_build", graph, n, [&rules]
+    {
+        auto b = crt::context::builder();
+
+        for (const auto& e : rules)
+        {
+            b.insert(e);
+        }
+        sink += b.build().size();
+    });
+
+    run(opts, "referencing", graph, n, [&ctx]
+    {
+        sink += ctx.referencing(node(0)).size();
+    });
+
+    run(opts, "sorted_keys", graph, n, [&ctx]
+    {
+        sink += ctx.sorted_keys().size();
+    });
+
+    run(opts, "resolve_full", graph, n, [&ctx, &funcs]
+    {
+        sink += crt::resolve_full(ctx, funcs).size();
+    });
+
+    run(opts, "resolve_native", graph, n, [&ctx, &natives]
+    {
+        sink += crt::resolve_full(ctx, natives).size();
+    });
+
+    run(opts, "resolve_parallel", graph, n, [&ctx, &funcs]
+    {
+        crt::worker_pool pool(4);
+        sink += crt::resolve_parallel(ctx, funcs, pool).size();
+    });
+
+    run(opts, "parse", graph, n, [&source]
+    {
+        sink += crt::context::parse(source).size();
+    });
+
+    run(opts, "parse_parallel", graph, n, [&source]
+    {
+        sink += crt::parse_context_parallel(source.data(), source.data() + source.size()).size();
+    });
+
+    run(opts, "unparse", graph, n, [&ctx]
+    {
+        sink += ctx.expr().unparse().size();
+    });
+
+    run(opts, "unparse_parallel", graph, n, [&ctx]
+    {
+        sink += crt::unparse_parallel(ctx.expr()).size();
+    });
+}
+
+template<typename Pool>
+static void bench_pool(const options_t& opts, const char* pool_name, std::size_t n)
+{
+    run(opts, "pool_throughput", pool_name, n, [n]
+    {
+        std::atomic<std::size_t> count(0);
+        {
+            Pool pool(4);
+
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                pool.enqueue("t" + std::to_string(i), [&count] (const std::atomic<bool>*)
+                {
+                    ++count;
+                    return crt::expression();
+                });
+            }
+            pool.stop_all();
+        }
+        sink += count;
+    });
+}
+
+
+
+
+//=============================================================================
+int main(int argc, const char* argv[])
+{
+    auto opts = options_t();
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (! std::strcmp(argv[i], "--max-size") && i + 1 < argc)
+        {
+            opts.max_size = std::stoul(argv[++i]);
+        }
+        else if (! std::strcmp(argv[i], "--repeat") && i + 1 < argc)
+        {
+            opts.repeat = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (! std::strcmp(argv[i], "--filter") && i + 1 < argc)
+        {
+            opts.filter = argv[++i];
+        }
+        else
+        {
+            std::cerr << "usage: bench [--max-size N] [--repeat R] [--filter substring]" << std::endl;
+            return 1;
+        }
+    }
+
+    for (std::size_t n = 1000; n <= opts.max_size; n *= 10)
+    {
+        bench_graph(opts, "chain", make_chain(n));
+        bench_graph(opts, "fan_out", make_fan_out(n));
+        bench_graph(opts, "diamonds", make_diamonds(n));
+        bench_graph(opts, "random", make_random(n));
+        bench_pool<crt::worker_pool>(opts, "worker_pool", n);
+        bench_pool<crt::stealing_pool>(opts, "stealing_pool", n);
+    }
+    return 0;
+}
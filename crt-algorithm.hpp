@@ -1,6 +1,15 @@
 #pragma once
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include "crt-expr.hpp"
 #include "crt-context.hpp"
+#include "crt-async.hpp"
+#include "crt-workers.hpp"
 
 
 
@@ -8,6 +17,8 @@
 //=============================================================================
 namespace crt {
 
+    class incremental;
+
     template <typename Range, typename T, typename Fn>
     T accumulate(Range&& r, T init, Fn fn);
 
@@ -16,9 +27,27 @@ namespace crt {
 
     inline auto insert_invalidate(expression e, context rules, context prods);
     inline auto resolution_of(context rules, context prods={}, unsigned int delay_ms=0);
-    inline context resolve_only(expression e, context prods={});
     inline context resolve_once(context rules, context prods={});
-    inline context resolve_full(context rules, context prods={});
+
+    template <typename CallAdapter=call_adapter>
+    context resolve_only(expression e, context prods={}, const CallAdapter& adapter=CallAdapter());
+
+    template <typename CallAdapter=call_adapter>
+    context resolve_full(context rules, context prods={}, const CallAdapter& adapter=CallAdapter());
+
+    inline context::set_t upstream_of(const context& rules, std::vector<ident> targets, const context& prods={});
+
+    template <typename CallAdapter=call_adapter>
+    context resolve_targets(context rules, std::vector<ident> targets, context prods={}, const CallAdapter& adapter=CallAdapter());
+
+    template <typename Pool, typename CallAdapter=call_adapter>
+    context resolve_parallel(context rules, context prods, Pool& pool, const CallAdapter& adapter=CallAdapter());
+
+    template <typename Pool, typename CallAdapter, typename Callback>
+    context resolve_parallel(context rules, context prods, Pool& pool, const CallAdapter& adapter, Callback on_products);
+
+    template <typename Pool>
+    auto products_of(context rules, context prods, Pool& pool);
 }
 
 
@@ -94,42 +123,816 @@ auto crt::resolution_of(context rules, context prods, unsigned int delay_ms)
     };
 }
 
-crt::context crt::resolve_full(context rules, context prods)
+/**
+ * Returns a function, that when passed to observable::create, yields an
+ * observable of resolutions (prods) of the given set of rules, like
+ * resolution_of. Rather than polling, the rules are resolved with
+ * resolve_parallel on the given pool, which is shared by every subscription
+ * and must outlive them, and the subscriber is called as soon as products
+ * are completed. Products
+ * that complete while the subscriber is busy are coalesced into its next
+ * snapshot. Once the subscriber unsubscribes, no further rules are started.
+ * Errors thrown by rules are passed to the subscriber's on_error.
+ */
+template <typename Pool>
+auto crt::products_of(context rules, context prods, Pool& pool)
 {
+    return [rules, prods, &pool] (auto s)
+    {
+        auto emit = [&s] (const context& p, const std::vector<ident>&)
+        {
+            if (! s.is_subscribed())
+            {
+                return false;
+            }
+            s.on_next(p);
+            return true;
+        };
+
+        try {
+            resolve_parallel(rules, prods, pool, call_adapter(), emit);
+        }
+        catch (...)
+        {
+            s.on_error(std::current_exception());
+            return;
+        }
+        s.on_completed();
+    };
+}
+
+/**
+ * Return the products (prods) extended by resolving every rule that can be
+ * resolved. The rules are visited once each in topological order, so that
+ * every rule's dependencies have been resolved (if they can be) by the time
+ * it is reached. Tables are evaluated by the given call adapter.
+ */
+template <typename CallAdapter>
+crt::context crt::resolve_full(context rules, context prods, const CallAdapter& adapter)
+{
+    auto trans = [&rules, &adapter] (auto p, const auto& key)
+    {
+        return resolve_only(rules.at(key), std::move(p), adapter);
+    };
+    return accumulate(rules.sorted_keys(), std::move(prods), trans);
+}
+
+/**
+ * Return the keys of the given target rules, and of the rules upstream of
+ * them, that don't already have products. The closure is found by walking
+ * incoming edges back from the targets, stopping at existing products.
+ */
+crt::context::set_t crt::upstream_of(const context& rules, std::vector<ident> targets, const context& prods)
+{
+    auto needed = context::set_t();
+    auto stack = std::move(targets);
+
+    while (! stack.empty())
+    {
+        auto key = stack.back();
+        stack.pop_back();
+
+        if (needed.count(key) || prods.count(key) || ! rules.count(key))
+        {
+            continue;
+        }
+        needed = std::move(needed).insert(key);
+
+        for (const auto& s : rules.get_incoming(key))
+        {
+            stack.push_back(s);
+        }
+    }
+    return needed;
+}
+
+/**
+ * Return the products (prods) extended by resolving the given target rules,
+ * and only the rules upstream of them that don't already have products. The
+ * upstream closure is found by walking incoming edges back from the targets,
+ * and is then resolved in topological order, like resolve_full. Targets that
+ * cannot be resolved are left out of the products.
+ */
+template <typename CallAdapter>
+crt::context crt::resolve_targets(context rules, std::vector<ident> targets, context prods, const CallAdapter& adapter)
+{
+    auto needed = upstream_of(rules, std::move(targets), prods);
+    auto trans = [&rules, &adapter] (auto p, const auto& key)
+    {
+        return resolve_only(rules.at(key), std::move(p), adapter);
+    };
+    return accumulate(rules.sorted_keys(needed), std::move(prods), trans);
+}
+
+/**
+ * Return the products (prods) extended by resolving every rule that can be
+ * resolved, like resolve_full, but evaluating the rules on the given worker
+ * pool (a worker_pool or stealing_pool). Each rule is submitted as soon as
+ * all of its dependencies are in the products, so independent rules run
+ * concurrently. A rule's priority is the length of the longest chain of
+ * rules downstream of it, so that the critical path of the graph is started
+ * first. Tasks are named by their rule key, prefixed by a tag unique to the
+ * call, so several calls may share a pool at once. A rule whose
+ * product is a crt::pending gives up its worker, and its product is recorded
+ * when the pending completes. If any rule throws, or completes a pending
+ * with an exception, no further rules are submitted, and the exception is
+ * rethrown here once the running tasks have finished. The call adapter is
+ * shared by all of the tasks, so it must be safe to use from several threads
+ * at once.
+ */
+template <typename Pool, typename CallAdapter>
+crt::context crt::resolve_parallel(context rules, context prods, Pool& pool, const CallAdapter& adapter)
+{
+    auto ignore = [] (const context&, const std::vector<ident>&) { return true; };
+    return resolve_parallel(rules, prods, pool, adapter, ignore);
+}
+
+/**
+ * Like resolve_parallel above, but calling on_products(prods, keys) on this
+ * thread whenever new products are available, where keys are the rules just
+ * resolved. Products that finish while the callback is running (or while
+ * this thread is otherwise busy) are delivered together in the next call, so
+ * a slow callback receives fewer, larger batches. The callback runs on the
+ * thread that submits rules, after the rules made ready by its batch are
+ * submitted; rules that become ready while it runs wait for it to return,
+ * so it should be quick if the pool is to stay busy. If the callback
+ * returns false, no further rules are submitted, and the products so far
+ * are returned once the running tasks have finished.
+ */
+template <typename Pool, typename CallAdapter, typename Callback>
+crt::context crt::resolve_parallel(context rules, context prods, Pool& pool, const CallAdapter& adapter, Callback on_products)
+{
+    struct completion_t
+    {
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::vector<expression> products;
+        std::exception_ptr error;
+
+        void deliver(expression p, std::exception_ptr x)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            products.push_back(std::move(p));
+
+            if (x && ! error)
+            {
+                error = x;
+            }
+            condition.notify_one();
+        }
+    };
+
+    // Tasks are identified to the pool and to instruments by the address of
+    // the completion record, which is unique for as long as any task of this
+    // call is in the pool.
+    auto done = std::make_shared<completion_t>();
+    auto run = reinterpret_cast<std::uintptr_t>(done.get());
+    auto tag = std::to_string(run) + ":";
+    auto height = std::unordered_map<ident, int>();
+    auto degree = std::unordered_map<ident, std::size_t>();
+    auto ready = std::vector<ident>();
+    std::size_t in_flight = 0;
+    std::exception_ptr error;
+
+
+    // Count, for each unresolved rule, the dependencies that are not yet
+    // products. A rule referencing a symbol that is neither a product nor a
+    // rule can never be resolved, so it is never made ready.
+    for (const auto& item : rules)
+    {
+        if (prods.count(item.first))
+        {
+            continue;
+        }
+
+        std::size_t n = 0;
+        bool resolvable = true;
+
+        for (const auto& s : rules.get_incoming(item.first))
+        {
+            if (! prods.count(s))
+            {
+                resolvable &= rules.count(s) == 1;
+                ++n;
+            }
+        }
+        if (! resolvable)
+        {
+            continue;
+        }
+        if (n == 0)
+        {
+            ready.push_back(item.first);
+        }
+        else
+        {
+            degree[item.first] = n;
+        }
+    }
+
+
+    // Find the length of the longest downstream chain from each rule.
+    auto order = rules.sorted_keys();
+
+    for (auto key = order.rbegin(); key != order.rend(); ++key)
+    {
+        int h = 0;
+
+        for (const auto& k : rules.get_outgoing(*key))
+        {
+            h = std::max(h, height[k] + 1);
+        }
+        height[*key] = h;
+    }
+
+
+    // Record a new product, and collect the rules it makes ready.
+    auto fresh = std::vector<ident>();
+    auto stopped = false;
+
+    auto finish = [&] (expression p)
+    {
+        auto key = p.key();
+        prods = std::move(prods).insert(std::move(p));
+        fresh.push_back(key);
+
+        for (const auto& k : rules.get_outgoing(key))
+        {
+            auto d = degree.find(k);
+
+            if (d != degree.end() && --d->second == 0)
+            {
+                ready.push_back(k);
+            }
+        }
+    };
+
+
     while (true)
     {
-        auto new_prods = resolve_once(rules, prods);
+        while (! ready.empty() && ! error && ! stopped)
+        {
+            auto key = ready.back();
+            auto e = rules.at(key);
+            ready.pop_back();
+
+            if (e.symbols().size() == 0)
+            {
+                finish(e);
+                continue;
+            }
+
+            auto scope = prods;
+            ++in_flight;
 
-        if (new_prods.size() == prods.size())
+            if (auto ins = instrument::installed())
+            {
+                ins->rule_queued(key, run);
+            }
+
+            pool.enqueue(tag + key.str(), [e, scope, done, run, &adapter] (const std::atomic<bool>*)
+            {
+                auto p = expression();
+                auto x = std::exception_ptr();
+
+                try {
+                    instrument::evaluation eval(e.key(), run);
+                    p = e.resolve(scope, adapter);
+                }
+                catch (...)
+                {
+                    x = std::current_exception();
+                }
+
+                if (auto later = x ? nullptr : pending::of(p))
+                {
+                    auto key = e.key();
+                    later->then([done, key] (const expression& value, std::exception_ptr y)
+                    {
+                        done->deliver(value.keyed(key), y);
+                    });
+                    return p;
+                }
+                done->deliver(p, x);
+                return p;
+            }, height[key]);
+        }
+
+        if (! fresh.empty() && ! error && ! stopped)
+        {
+            stopped = ! on_products(prods, fresh);
+        }
+        fresh.clear();
+
+        if (in_flight == 0)
         {
             break;
         }
-        prods = std::move(new_prods);
+
+        auto products = std::vector<expression>();
+        {
+            std::unique_lock<std::mutex> lock(done->mutex);
+            done->condition.wait(lock, [&done] { return ! done->products.empty(); });
+            products.swap(done->products);
+            error = done->error;
+        }
+
+        in_flight -= products.size();
+
+        if (! error)
+        {
+            for (auto& p : products)
+            {
+                finish(std::move(p));
+            }
+        }
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
     }
     return prods;
 }
 
+//=============================================================================
+/**
+ * A pair of rules and their products, which records the keys that have
+ * changed since the last resolve. Resolving re-evaluates only the rules
+ * downstream of those keys, in dependency order. If a re-evaluated product
+ * has the same value as before, the rules that reference it are not
+ * re-evaluated on its account (early cutoff). Like context, this class is
+ * immutable.
+ */
+class crt::incremental
+{
+public:
+
+
+    /**
+     * Construct from a set of rules, and products that (if non-empty) are
+     * up-to-date with those rules. Rules without a product are marked as
+     * changed, so the first resolve will try to produce them.
+     */
+    incremental(context rules={}, context prods={}) : rules(rules), prods(prods)
+    {
+        for (const auto& item : rules)
+        {
+            if (! prods.count(item.first))
+            {
+                dirty = std::move(dirty).insert(item.first);
+            }
+        }
+    }
+
+
+    /**
+     * Return a copy with the given rule inserted, and its key marked as
+     * changed. Throws std::invalid_argument if the rule would create a
+     * dependency cycle.
+     */
+    incremental insert(expression e) const
+    {
+        auto result = *this;
+        result.rules = rules.insert(e);
+        result.dirty = dirty.insert(e.key());
+        return result;
+    }
+
+
+    /**
+     * Return a copy with the given rule erased, and its key marked as
+     * changed.
+     */
+    incremental erase(ident key) const
+    {
+        auto result = *this;
+        result.rules = rules.erase(key);
+        result.dirty = dirty.insert(key);
+        return result;
+    }
+
+
+    /**
+     * Return a copy whose products are brought up-to-date with the rules,
+     * and with no keys marked as changed. This is proportional to the size
+     * of the graph downstream of the changed keys, not the whole context.
+     */
+    incremental resolve() const
+    {
+        auto affected = context::set_t();
+        auto changed = context::set_t();
+        auto result = *this;
+
+        for (const auto& k : dirty)
+        {
+            for (const auto& m : rules.referencing(k))
+            {
+                affected = std::move(affected).insert(m);
+            }
+            if (! rules.count(k) && prods.count(k))
+            {
+                result.prods = std::move(result.prods).erase(k);
+                changed = std::move(changed).insert(k);
+            }
+        }
+
+        for (const auto& key : rules.sorted_keys(affected))
+        {
+            const auto& rule = rules.at(key);
+            auto had = prods.count(key) != 0;
+            auto stale = dirty.count(key) != 0;
+
+            for (const auto& s : rule.symbols())
+            {
+                if (stale || changed.count(s))
+                {
+                    stale = true;
+                    break;
+                }
+            }
+            if (had && ! stale)
+            {
+                continue;
+            }
+
+            result.prods = resolve_only(rule, std::move(result.prods).erase(key));
+
+            if (! result.prods.count(key))
+            {
+                if (had)
+                {
+                    changed = std::move(changed).insert(key);
+                }
+            }
+            else if (! had || ! result.prods.at(key).has_same_value(prods.at(key)))
+            {
+                changed = std::move(changed).insert(key);
+            }
+        }
+        result.dirty = {};
+        return result;
+    }
+
+
+    const context& get_rules()           const { return rules; }
+    const context& get_products()        const { return prods; }
+    const context::set_t& get_changed()  const { return dirty; }
+
+
+private:
+    context rules;
+    context prods;
+    context::set_t dirty;
+};
+
+
+
+
+//=============================================================================
 crt::context crt::resolve_once(context rules, context prods)
 {
     auto trans = [] (auto p, auto i)
     {
-        return resolve_only(i.second, p);
+        return resolve_only(i.second, std::move(p));
     };
-    return accumulate(rules, prods, trans);
+    return accumulate(rules, std::move(prods), trans);
 }
 
-crt::context crt::resolve_only(expression e, context prods)
+template <typename CallAdapter>
+crt::context crt::resolve_only(expression e, context prods, const CallAdapter& adapter)
 {
     if (! prods.count(e.key()))
     {
         if (e.symbols().size() == 0)
         {
-            return prods.insert(e);
+            return std::move(prods).insert(std::move(e));
         }
         else if (contains(prods, e.symbols()))
         {
-            return prods.insert(e.resolve(prods, call_adapter()));
+            auto p = expression();
+            {
+                instrument::evaluation eval(e.key());
+                p = await(e.resolve(prods, adapter));
+            }
+            return std::move(prods).insert(std::move(p));
         }
     }
     return prods;
 }
+
+
+
+
+//=============================================================================
+#ifdef TEST_ALGORITHM
+#include "catch.hpp"
+using namespace crt;
+
+
+
+
+//=============================================================================
+TEST_CASE("resolve_full resolves everything in a single pass", "[algorithm]")
+{
+    SECTION("for a linear chain")
+    {
+        auto rules = context::parse("(a=b b=c c=d d=e e=f f=g g=h h=i i=j j=10)");
+        auto prods = resolve_full(rules);
+        REQUIRE(prods.size() == rules.size());
+        REQUIRE(prods.at("a").get_i32() == 10);
+    }
+    SECTION("rules with unresolvable symbols are left out")
+    {
+        auto rules = context::parse("(a=b b=c c=missing d=1)");
+        auto prods = resolve_full(rules);
+        REQUIRE(prods.size() == 1);
+        REQUIRE(prods.at("d").get_i32() == 1);
+    }
+    SECTION("existing products are kept")
+    {
+        auto rules = context::parse("(a=b b=1)");
+        auto prods = resolve_full(rules, context().insert(expression(2).keyed("b")));
+        REQUIRE(prods.at("a").get_i32() == 2);
+    }
+}
+
+
+
+
+TEST_CASE("resolve_targets resolves only the upstream closure", "[algorithm]")
+{
+    auto calls = std::make_shared<std::atomic<int>>(0);
+    auto count = [calls] (expression e) { ++*calls; return e.first(); };
+    auto funcs = context().insert(expression(func_t(count)).keyed("f"));
+    auto rules = context::parse("(a=(f 1) b=(f a) c=(f b) d=(f a) e=(f d) g=(f x))");
+
+    auto prods = resolve_targets(rules, {"c"}, funcs);
+    REQUIRE(prods.at("c").get_i32() == 1);
+    REQUIRE(prods.count("d") == 0);
+    REQUIRE(*calls == 3);
+
+    prods = resolve_targets(rules, {"e", "c", "g"}, prods);
+    REQUIRE(prods.at("e").get_i32() == 1);
+    REQUIRE(prods.count("g") == 0);
+    REQUIRE(*calls == 5);
+}
+
+
+
+
+TEST_CASE("resolve_parallel agrees with resolve_full", "[algorithm]")
+{
+    auto add = [] (expression e)
+    {
+        int total = 0;
+
+        for (const auto& part : e)
+        {
+            total += int(*part);
+        }
+        return expression(total);
+    };
+    worker_pool pool(4);
+    auto funcs = context().insert(expression(func_t(add)).keyed("add"));
+
+    SECTION("for a wide diamond")
+    {
+        auto rules = context::parse("(a=1 b=(add a 1) c=(add a 2) d=(add a 3) e=(add b c d) f=(add e x) g=(add 1 2))");
+        auto prods = resolve_parallel(rules, funcs, pool);
+        REQUIRE(prods.at("e").get_i32() == 9);
+        REQUIRE(prods.at("g").get_i32() == 3);
+        REQUIRE(prods.count("f") == 0);
+        REQUIRE(prods.size() == resolve_full(rules, funcs).size());
+    }
+    SECTION("for a linear chain")
+    {
+        auto rules = context::parse("(a=(add b 1) b=(add c 1) c=(add d 1) d=(add e 1) e=0)");
+        REQUIRE(resolve_parallel(rules, funcs, pool).at("a").get_i32() == 4);
+    }
+    SECTION("with a shared memoizing call adapter")
+    {
+        auto calls = std::make_shared<std::atomic<int>>(0);
+        auto slow = [calls] (expression e) { ++*calls; return e.first(); };
+        auto f = funcs.insert(expression(func_t(slow)).keyed("slow"));
+        auto rules = context::parse("(a=(add (slow 1) 1) b=(add (slow 1) 2) c=(add a b (slow 1)))");
+        memoizing_call_adapter memo;
+        memo.mark_pure("slow");
+        auto serial = resolve_full(rules, f, memo);
+        REQUIRE(serial.at("c").get_i32() == 6);
+        REQUIRE(*calls == 1);
+        REQUIRE(resolve_parallel(rules, f, pool, memo).at("c").get_i32() == 6);
+        REQUIRE(*calls == 1);
+    }
+    SECTION("from several threads on one pool")
+    {
+        auto rules = context::parse("(a=1 b=(add a 1) c=(add a 2) d=(add b c))");
+        auto results = std::vector<int>(4);
+        auto threads = std::vector<std::thread>();
+
+        for (std::size_t i = 0; i < results.size(); ++i)
+        {
+            threads.emplace_back([&, i] { results[i] = resolve_parallel(rules, funcs, pool).at("d").get_i32(); });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        REQUIRE(results == std::vector<int>(4, 5));
+    }
+    SECTION("on a stealing_pool")
+    {
+        stealing_pool stealing(4);
+        auto rules = context::parse("(a=1 b=(add a 1) c=(add a 2) d=(add b c))");
+        REQUIRE(resolve_parallel(rules, funcs, stealing).at("d").get_i32() == 5);
+    }
+    SECTION("exceptions thrown by rules are rethrown")
+    {
+        auto fail = [] (expression) -> expression { throw std::runtime_error("fail"); };
+        auto f = funcs.insert(expression(func_t(fail)).keyed("fail"));
+        auto rules = context::parse("(a=(fail 1) b=(add a 1) c=(add 1 1))");
+        REQUIRE_THROWS(resolve_parallel(rules, f, pool));
+    }
+    SECTION("products are delivered as they complete")
+    {
+        auto rules = context::parse("(a=1 b=(add a 1) c=(add a 2) d=(add b c) e=(add d 1))");
+        auto keys = std::vector<ident>();
+        auto calls = 0;
+        auto prods = resolve_parallel(rules, funcs, pool, call_adapter(), [&] (const context& p, const std::vector<ident>& fresh)
+        {
+            for (const auto& k : fresh)
+            {
+                REQUIRE(p.count(k));
+                keys.push_back(k);
+            }
+            ++calls;
+            return true;
+        });
+        REQUIRE(keys.size() == 5);
+        REQUIRE(calls >= 4);
+        REQUIRE(prods.at("e").get_i32() == 6);
+    }
+    SECTION("no further rules are started once the callback returns false")
+    {
+        auto rules = context::parse("(a=(add 1 1) b=(add a 1) c=(add b 1))");
+        auto prods = resolve_parallel(rules, funcs, pool, call_adapter(), [] (const context&, const std::vector<ident>&)
+        {
+            return false;
+        });
+        REQUIRE(prods.count("a") == 1);
+        REQUIRE(prods.count("c") == 0);
+    }
+    SECTION("products_of pushes snapshots to a subscriber")
+    {
+        struct subscriber_t
+        {
+            std::vector<context>* snapshots;
+            bool* completed;
+            bool is_subscribed() const { return true; }
+            void on_next(context c) const { snapshots->push_back(c); }
+            void on_error(std::exception_ptr) const {}
+            void on_completed() const { *completed = true; }
+        };
+        auto snapshots = std::vector<context>();
+        auto completed = false;
+        auto rules = context::parse("(a=1 b=(add a 1) c=(add b 1))");
+
+        products_of(rules, funcs, pool)(subscriber_t{&snapshots, &completed});
+        REQUIRE(completed);
+        REQUIRE(snapshots.size() == 3);
+        REQUIRE(snapshots.back().at("c").get_i32() == 3);
+    }
+}
+
+
+
+
+TEST_CASE("incremental re-resolves only what changed", "[algorithm]")
+{
+    auto calls = std::make_shared<int>(0);
+    auto mod2 = [calls] (expression e)
+    {
+        ++*calls;
+        return expression(int(e.first()) % 2);
+    };
+    auto rules = context::parse("(a=1 b=(mod2 a) c=(mod2 b) d=(mod2 e) e=4)")
+    .insert(expression(func_t(mod2)).keyed("mod2"));
+    auto inc = incremental(rules).resolve();
+
+    REQUIRE(inc.get_changed().empty());
+    REQUIRE(inc.get_products().size() == rules.size());
+    REQUIRE(inc.get_products().at("c").get_i32() == 1);
+    REQUIRE(inc.get_products().at("d").get_i32() == 0);
+    REQUIRE(*calls == 3);
+
+    SECTION("an edit that produces the same value cuts off downstream rules")
+    {
+        auto next = inc.insert(expression(3).keyed("a")).resolve();
+        REQUIRE(next.get_products().at("a").get_i32() == 3);
+        REQUIRE(next.get_products().at("c").get_i32() == 1);
+        REQUIRE(*calls == 4);
+    }
+    SECTION("an edit that changes a value propagates")
+    {
+        auto next = inc.insert(expression(2).keyed("a")).resolve();
+        REQUIRE(next.get_products().at("b").get_i32() == 0);
+        REQUIRE(next.get_products().at("c").get_i32() == 0);
+        REQUIRE(*calls == 5);
+    }
+    SECTION("erasing a rule removes the products that depend on it")
+    {
+        auto next = inc.erase("e").resolve();
+        REQUIRE(next.get_products().count("e") == 0);
+        REQUIRE(next.get_products().count("d") == 0);
+        REQUIRE(next.get_products().count("c") == 1);
+        REQUIRE(next.insert(expression(5).keyed("e")).resolve().get_products().at("d").get_i32() == 1);
+    }
+}
+
+
+
+
+TEST_CASE("pending products do not hold a worker", "[algorithm]")
+{
+    auto started = std::make_shared<std::vector<pending>>();
+    auto mutex = std::make_shared<std::mutex>();
+    auto load = [started, mutex] (expression)
+    {
+        auto p = pending();
+        std::lock_guard<std::mutex> lock(*mutex);
+        started->push_back(p);
+        return p.expr();
+    };
+    auto add = [] (expression e)
+    {
+        return expression(e.first().get_i32() + e.second().get_i32());
+    };
+    auto funcs = context()
+    .insert(expression(func_t(load)).keyed("load"))
+    .insert(expression(func_t(add)).keyed("add"));
+    auto rules = context::parse("(a=(load 'a') b=(load 'b') c=(load 'c') d=(add 1 2) e=(add a b))");
+
+    SECTION("in resolve_parallel, with one worker")
+    {
+        std::thread io([started, mutex]
+        {
+            while (true)
+            {
+                std::lock_guard<std::mutex> lock(*mutex);
+
+                if (started->size() == 3)
+                {
+                    break;
+                }
+            }
+            for (std::size_t i = 0; i < 3; ++i)
+            {
+                (*started)[i].set_value(int(i + 1));
+            }
+        });
+
+        worker_pool pool(1);
+        auto prods = resolve_parallel(rules, funcs, pool);
+        io.join();
+
+        REQUIRE(prods.at("d").get_i32() == 3);
+        REQUIRE(prods.at("e").get_i32() + prods.at("c").get_i32() == 6);
+        REQUIRE(prods.at("e").key() == ident("e"));
+    }
+    SECTION("with errors, which are rethrown")
+    {
+        auto fail = [] (expression)
+        {
+            auto p = pending();
+            std::thread([p] { p.set_exception(std::make_exception_ptr(std::runtime_error("no such file"))); }).detach();
+            return p.expr();
+        };
+        worker_pool pool(2);
+        REQUIRE_THROWS_AS(resolve_parallel(rules, funcs.insert(expression(func_t(fail)).keyed("load")), pool), std::runtime_error);
+    }
+    SECTION("in resolve_full, which waits")
+    {
+        std::atomic<bool> done(false);
+        std::thread io([started, mutex, &done]
+        {
+            std::size_t n = 0;
+
+            while (n < 3)
+            {
+                std::lock_guard<std::mutex> lock(*mutex);
+
+                for (; n < started->size(); ++n)
+                {
+                    (*started)[n].set_value(10);
+                }
+            }
+            done = true;
+        });
+        auto prods = resolve_full(rules, funcs);
+        io.join();
+        REQUIRE(done);
+        REQUIRE(prods.at("e").get_i32() == 20);
+    }
+}
+
+#endif // TEST_ALGORITHM
\ No newline at end of file
@@ -0,0 +1,506 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "crt-expr.hpp"
+#include "crt-context.hpp"
+
+
+
+
+//=============================================================================
+namespace crt {
+    template<typename T> class dense_array;
+    using f64_array = dense_array<double>;
+    using i32_array = dense_array<int>;
+    inline context array_builtins();
+}
+
+
+
+
+//=============================================================================
+/**
+ * A contiguous array of numbers, held in an expression as user_data. The
+ * elements are shared between copies and never modified, so copying an
+ * array or taking a slice of it is O(1). Use array_builtins for functions
+ * operating on arrays.
+ */
+template<typename T>
+class crt::dense_array
+{
+public:
+
+
+    //=========================================================================
+    dense_array() : dense_array(std::vector<T>()) {}
+
+    explicit dense_array(std::vector<T> v)
+    : values(std::make_shared<const std::vector<T>>(std::move(v)))
+    , offset(0)
+    , length(values->size())
+    {
+    }
+
+    dense_array(std::size_t n, T fill) : dense_array(std::vector<T>(n, fill)) {}
+
+
+    //=========================================================================
+    const T* data()  const { return values->data() + offset; }
+    const T* begin() const { return data(); }
+    const T* end()   const { return data() + length; }
+    std::size_t size() const { return length; }
+    T operator[](std::size_t i) const { return data()[i]; }
+
+
+    /**
+     * Return the elements in [start, stop), sharing this array's storage.
+     * The bounds are clamped to the size of the array.
+     */
+    dense_array slice(std::size_t start, std::size_t stop) const
+    {
+        auto result = *this;
+        stop = std::min(stop, length);
+        start = std::min(start, stop);
+        result.offset = offset + start;
+        result.length = stop - start;
+        return result;
+    }
+
+
+private:
+    //=========================================================================
+    std::shared_ptr<const std::vector<T>> values;
+    std::size_t offset;
+    std::size_t length;
+};
+
+
+
+
+//=============================================================================
+namespace crt {
+    template<typename T> struct type_info<dense_array<T>>
+    {
+        static const char* name()
+        {
+            return std::is_same<T, double>::value ? "f64_array" : "i32_array";
+        }
+
+        static expression to_table(const dense_array<T>& a)
+        {
+            auto parts = cont_t().transient();
+
+            for (auto x : a)
+            {
+                parts.push_back(expression(x));
+            }
+            return parts.persistent();
+        }
+
+        static dense_array<T> from_expr(const expression& e)
+        {
+            if (auto a = std::dynamic_pointer_cast<capsule<dense_array<T>>>(e.get_data()))
+            {
+                return a->value;
+            }
+
+            auto values = std::vector<T>();
+            values.reserve(e.size());
+
+            for (const auto& part : e)
+            {
+                values.push_back(std::is_same<T, double>::value ? T(part->as_f64()) : T(part->as_i32()));
+            }
+            return dense_array<T>(std::move(values));
+        }
+
+        /**
+         * Snapshots store the elements as raw bytes, in the host byte order.
+         */
+        static void serialize(const dense_array<T>& a, std::string& out)
+        {
+            out.append(reinterpret_cast<const char*>(a.data()), a.size() * sizeof(T));
+        }
+
+        /**
+         * A slice is counted at its own length, even if it shares storage.
+         */
+        static std::size_t size_bytes(const dense_array<T>& a)
+        {
+            return sizeof(a) + a.size() * sizeof(T);
+        }
+
+        static dense_array<T> deserialize(const char* data, std::size_t size)
+        {
+            auto values = std::vector<T>(size / sizeof(T));
+            std::memcpy(values.data(), data, values.size() * sizeof(T));
+            return dense_array<T>(std::move(values));
+        }
+    };
+}
+
+
+
+
+//=============================================================================
+namespace crt {
+namespace array_kernels {
+
+
+    /**
+     * A read-only view of f64 values: an f64_array, an i32_array (converted),
+     * or a scalar broadcast to any length.
+     */
+    struct operand_t
+    {
+        const double* data = nullptr;
+        std::size_t size = 0;
+        double scalar = 0.0;
+        bool broadcast = false;
+        std::vector<double> converted;
+
+        bool is_scalar() const { return broadcast; }
+    };
+
+    inline operand_t operand(const expression& e)
+    {
+        auto result = operand_t();
+
+        if (auto a = std::dynamic_pointer_cast<capsule<f64_array>>(e.get_data()))
+        {
+            result.data = a->value.data();
+            result.size = a->value.size();
+        }
+        else if (auto b = std::dynamic_pointer_cast<capsule<i32_array>>(e.get_data()))
+        {
+            result.converted.assign(b->value.begin(), b->value.end());
+            result.data = result.converted.data();
+            result.size = result.converted.size();
+        }
+        else if (e.has_type(data_type::i32) || e.has_type(data_type::f64))
+        {
+            result.scalar = e.as_f64();
+            result.broadcast = true;
+        }
+        else
+        {
+            throw std::invalid_argument(std::string("expected an array or number, got ") + e.type_name());
+        }
+        return result;
+    }
+
+    inline const f64_array& f64(const expression& e)
+    {
+        return e.check_data<f64_array>();
+    }
+
+    inline expression wrap(std::vector<double> v)
+    {
+        return make_data(f64_array(std::move(v)));
+    }
+
+
+    /**
+     * Apply op elementwise to two operands, broadcasting a scalar against an
+     * array. The loops run over plain pointers, so they can be vectorized.
+     */
+    template<typename Op>
+    expression elementwise(const expression& args, Op op)
+    {
+        auto a = operand(args.first());
+        auto b = operand(args.second());
+
+        if (a.is_scalar() && b.is_scalar())
+        {
+            return op(a.scalar, b.scalar);
+        }
+        if (! a.is_scalar() && ! b.is_scalar() && a.size != b.size)
+        {
+            throw std::invalid_argument("array sizes do not match: "
+                + std::to_string(a.size) + " and "
+                + std::to_string(b.size));
+        }
+
+        auto n = a.is_scalar() ? b.size : a.size;
+        auto result = std::vector<double>(n);
+        auto out = result.data();
+
+        if (a.is_scalar())
+        {
+            auto x = a.scalar;
+            auto y = b.data;
+            for (std::size_t i = 0; i < n; ++i) out[i] = op(x, y[i]);
+        }
+        else if (b.is_scalar())
+        {
+            auto x = a.data;
+            auto y = b.scalar;
+            for (std::size_t i = 0; i < n; ++i) out[i] = op(x[i], y);
+        }
+        else
+        {
+            auto x = a.data;
+            auto y = b.data;
+            for (std::size_t i = 0; i < n; ++i) out[i] = op(x[i], y[i]);
+        }
+        return wrap(std::move(result));
+    }
+
+
+    /**
+     * Fold an array with four independent accumulators, which are combined
+     * at the end, so the loop is not serialized on a single dependency.
+     */
+    template<typename Op>
+    double reduce(const double* x, std::size_t n, double init, Op op)
+    {
+        double acc[4] = {init, init, init, init};
+        std::size_t i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            acc[0] = op(acc[0], x[i + 0]);
+            acc[1] = op(acc[1], x[i + 1]);
+            acc[2] = op(acc[2], x[i + 2]);
+            acc[3] = op(acc[3], x[i + 3]);
+        }
+        for (; i < n; ++i)
+        {
+            acc[0] = op(acc[0], x[i]);
+        }
+        return op(op(acc[0], acc[1]), op(acc[2], acc[3]));
+    }
+
+    template<typename Op>
+    expression reduction(const expression& args, double init, Op op)
+    {
+        auto a = operand(args.first());
+        return a.is_scalar() ? a.scalar : reduce(a.data, a.size, init, op);
+    }
+
+    template<typename T>
+    expression make_array(const expression& args)
+    {
+        if (args.size() == 1 && args.first().has_type(data_type::table))
+        {
+            return make_data(type_info<dense_array<T>>::from_expr(args.first()));
+        }
+        return make_data(type_info<dense_array<T>>::from_expr(args));
+    }
+}
+}
+
+
+
+
+//=============================================================================
+/**
+ * Return a context of functions on arrays, to be included in the products
+ * (or any scope) that rules are resolved against. The arithmetic functions
+ * take two arrays of equal size, or an array and a number, and return an
+ * f64_array; i32_array operands are converted to f64.
+ *
+ * f64-array, i32-array  : (f64-array 1 2 3) or (f64-array (1 2 3))
+ * array-fill            : (array-fill n value)
+ * array-range           : (array-range n), the values 0 through n - 1
+ * array-add, -sub, -mul, -div : elementwise arithmetic
+ * array-sum, -min, -max, -mean : reductions, returning an f64
+ * array-dot             : (array-dot a b)
+ * array-len             : the number of elements, as an i32
+ * array-at              : (array-at a i), the element at index i
+ * array-slice           : (array-slice a start stop), sharing a's storage
+ */
+crt::context crt::array_builtins()
+{
+    using namespace array_kernels;
+
+    auto b = context::builder();
+    auto def = [&b] (const char* name, func_t f)
+    {
+        b.insert(expression(f).keyed(name));
+    };
+
+    def("f64-array", [] (expression e) { return make_array<double>(e); });
+    def("i32-array", [] (expression e) { return make_array<int>(e); });
+
+    def("array-fill", [] (expression e)
+    {
+        return wrap(std::vector<double>(std::max(e.first().as_i32(), 0), e.second().as_f64()));
+    });
+
+    def("array-range", [] (expression e)
+    {
+        auto result = std::vector<double>(std::max(e.first().as_i32(), 0));
+        auto out = result.data();
+        for (std::size_t i = 0; i < result.size(); ++i) out[i] = double(i);
+        return wrap(std::move(result));
+    });
+
+    def("array-add", [] (expression e) { return elementwise(e, [] (double x, double y) { return x + y; }); });
+    def("array-sub", [] (expression e) { return elementwise(e, [] (double x, double y) { return x - y; }); });
+    def("array-mul", [] (expression e) { return elementwise(e, [] (double x, double y) { return x * y; }); });
+    def("array-div", [] (expression e) { return elementwise(e, [] (double x, double y) { return x / y; }); });
+
+    def("array-sum", [] (expression e) { return reduction(e, 0.0, [] (double x, double y) { return x + y; }); });
+    def("array-min", [] (expression e) { return reduction(e, HUGE_VAL, [] (double x, double y) { return std::min(x, y); }); });
+    def("array-max", [] (expression e) { return reduction(e, -HUGE_VAL, [] (double x, double y) { return std::max(x, y); }); });
+
+    def("array-mean", [] (expression e)
+    {
+        auto a = operand(e.first());
+        return a.is_scalar() ? a.scalar : reduce(a.data, a.size, 0.0, [] (double x, double y) { return x + y; }) / a.size;
+    });
+
+    def("array-dot", [] (expression e)
+    {
+        auto a = operand(e.first());
+        auto b = operand(e.second());
+
+        if (a.is_scalar() || b.is_scalar() || a.size != b.size)
+        {
+            throw std::invalid_argument("array-dot needs two arrays of the same size");
+        }
+
+        double acc[4] = {0.0, 0.0, 0.0, 0.0};
+        auto x = a.data;
+        auto y = b.data;
+        std::size_t i = 0;
+
+        for (; i + 4 <= a.size; i += 4)
+        {
+            acc[0] += x[i + 0] * y[i + 0];
+            acc[1] += x[i + 1] * y[i + 1];
+            acc[2] += x[i + 2] * y[i + 2];
+            acc[3] += x[i + 3] * y[i + 3];
+        }
+        for (; i < a.size; ++i)
+        {
+            acc[0] += x[i] * y[i];
+        }
+        return expression((acc[0] + acc[1]) + (acc[2] + acc[3]));
+    });
+
+    def("array-len", [] (expression e)
+    {
+        return expression(int(operand(e.first()).size));
+    });
+
+    def("array-at", [] (expression e)
+    {
+        auto i = e.second().as_i32();
+
+        auto at = [i] (const auto& a)
+        {
+            if (i < 0 || std::size_t(i) >= a.size())
+            {
+                throw std::out_of_range("array-at: index out of range");
+            }
+            return expression(double(a[i]));
+        };
+
+        if (auto a = std::dynamic_pointer_cast<capsule<i32_array>>(e.first().get_data()))
+        {
+            return at(a->value);
+        }
+        if (auto a = std::dynamic_pointer_cast<capsule<f64_array>>(e.first().get_data()))
+        {
+            return at(a->value);
+        }
+        if (e.first().has_type(data_type::i32) || e.first().has_type(data_type::f64))
+        {
+            throw std::out_of_range("array-at: index out of range");
+        }
+        throw std::invalid_argument(std::string("expected an array or number, got ") + e.first().type_name());
+    });
+
+    def("array-slice", [] (expression e)
+    {
+        auto start = std::size_t(std::max(e.second().as_i32(), 0));
+        auto stop = std::size_t(std::max(e.third().as_i32(), 0));
+
+        if (auto a = std::dynamic_pointer_cast<capsule<i32_array>>(e.first().get_data()))
+        {
+            return expression(make_data(a->value.slice(start, stop)));
+        }
+        return expression(make_data(f64(e.first()).slice(start, stop)));
+    });
+
+    return std::move(b).build();
+}
+
+
+
+
+//=============================================================================
+#ifdef TEST_ARRAY
+#include "catch.hpp"
+#include "crt-algorithm.hpp"
+#include "crt-serial.hpp"
+
+
+
+
+//=============================================================================
+TEST_CASE("dense arrays and their builtins", "[array]")
+{
+    using namespace crt;
+
+    auto builtins = array_builtins();
+
+    SECTION("arrays convert to and from tables")
+    {
+        auto a = parse("(1 2.5 3)").to<f64_array>();
+        REQUIRE(a.size() == 3);
+        REQUIRE(a[1] == 2.5);
+        REQUIRE(expression::from(a) == parse("(1.0 2.5 3.0)"));
+        REQUIRE(a.slice(1, 10).size() == 2);
+        REQUIRE(a.slice(1, 10)[0] == 2.5);
+        REQUIRE(a.slice(5, 2).size() == 0);
+    }
+    SECTION("rules can compute with arrays")
+    {
+        auto rules = context::parse(
+            "(x=(array-range 1000)"
+            " y=(array-mul x 2)"
+            " z=(array-add x y)"
+            " total=(array-sum z)"
+            " top=(array-max (array-slice z 10 20))"
+            " first=(array-at (f64-array 4 5 6) 0)"
+            " n=(array-len (i32-array (1 2 3 4)))"
+            " third=(array-at (array-slice (i32-array 1 2 3 4) 1 4) 2)"
+            " d=(array-dot (f64-array 1 2 3) (f64-array 4 5 6)))");
+        auto prods = resolve_full(rules, builtins);
+        REQUIRE(prods.at("total").get_f64() == 3 * 999 * 1000 / 2);
+        REQUIRE(prods.at("top").get_f64() == 57.0);
+        REQUIRE(prods.at("first").get_f64() == 4.0);
+        REQUIRE(prods.at("n").get_i32() == 4);
+        REQUIRE(prods.at("third").get_f64() == 4.0);
+        REQUIRE(prods.at("d").get_f64() == 32.0);
+        REQUIRE(prods.at("z").check_data<f64_array>().size() == 1000);
+    }
+    SECTION("mismatched sizes are rejected")
+    {
+        auto rules = context::parse("(z=(array-add (f64-array 1 2) (f64-array 1 2 3)))");
+        REQUIRE_THROWS_AS(resolve_full(rules, builtins), std::invalid_argument);
+        REQUIRE_THROWS_AS(resolve_full(context::parse("(a=(array-at (i32-array 1 2) 2))"), builtins), std::out_of_range);
+        REQUIRE_THROWS_AS(resolve_full(context::parse("(a=(array-at 1 0))"), builtins), std::out_of_range);
+    }
+    SECTION("arrays round-trip through snapshots")
+    {
+        auto w = snapshot_writer();
+        w.write(expression(make_data(f64_array(1000, 0.5))));
+
+        auto r = snapshot_reader(w.str().data(), w.str().data() + w.str().size());
+        auto a = r.add_type<f64_array>().read_expression().check_data<f64_array>();
+        REQUIRE(a.size() == 1000);
+        REQUIRE(a[999] == 0.5);
+    }
+}
+
+#endif // TEST_ARRAY
@@ -0,0 +1,190 @@
+#pragma once
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "crt-expr.hpp"
+
+
+
+
+//=============================================================================
+namespace crt {
+    class pending;
+    inline expression await(expression e);
+}
+
+
+
+
+//=============================================================================
+/**
+ * An expression whose value is not available yet, like a promise and its
+ * future in one. A function that starts slow I/O can return pending.expr()
+ * right away, and complete it later from an I/O callback or another thread:
+ *
+ *     auto load = [io] (crt::expression args)
+ *     {
+ *         auto p = crt::pending();
+ *         io->read(args.first().get_str(), [p] (std::string data) { p.set_value(data); });
+ *         return p.expr();
+ *     };
+ *
+ * resolve_parallel does not hold a worker while a rule's product is pending;
+ * it records the product when the pending completes. The other resolvers
+ * wait for it (see crt::await). Only a pending returned as the whole
+ * product is recognized, not one nested inside a table.
+ */
+class crt::pending
+{
+public:
+    using callback_t = std::function<void(const expression&, std::exception_ptr)>;
+
+
+    //=========================================================================
+    pending() : state(std::make_shared<state_t>()) {}
+
+
+    /**
+     * Return the pending that an expression holds, or nullptr if it does not
+     * hold one.
+     */
+    static const pending* of(const expression& e)
+    {
+        auto c = std::dynamic_pointer_cast<capsule<pending>>(e.get_data());
+        return c ? &c->value : nullptr;
+    }
+
+
+    /**
+     * Return a user_data expression holding this pending.
+     */
+    expression expr() const
+    {
+        return make_data(*this);
+    }
+
+
+    /**
+     * Complete with a value or an exception. Callbacks registered with then
+     * are called on the completing thread. Throws std::logic_error if this
+     * has already completed.
+     */
+    void set_value(expression value) const
+    {
+        complete(std::move(value), nullptr);
+    }
+
+    void set_exception(std::exception_ptr error) const
+    {
+        complete(expression(), error);
+    }
+
+
+    /**
+     * Call fn with the value (or exception) once completed: right away, if
+     * this has completed already.
+     */
+    void then(callback_t fn) const
+    {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+
+            if (! state->done)
+            {
+                state->callbacks.push_back(std::move(fn));
+                return;
+            }
+        }
+        fn(state->value, state->error);
+    }
+
+    bool ready() const
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->done;
+    }
+
+
+    /**
+     * Block until completed, and return the value or rethrow the exception.
+     */
+    expression get() const
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->condition.wait(lock, [this] { return state->done; });
+
+        if (state->error)
+        {
+            std::rethrow_exception(state->error);
+        }
+        return state->value;
+    }
+
+
+private:
+    //=========================================================================
+    struct state_t
+    {
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool done = false;
+        expression value;
+        std::exception_ptr error;
+        std::vector<callback_t> callbacks;
+    };
+
+    void complete(expression value, std::exception_ptr error) const
+    {
+        auto callbacks = std::vector<callback_t>();
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+
+            if (state->done)
+            {
+                throw std::logic_error("pending: already completed");
+            }
+            state->done = true;
+            state->value = std::move(value);
+            state->error = error;
+            callbacks.swap(state->callbacks);
+        }
+        state->condition.notify_all();
+
+        for (const auto& fn : callbacks)
+        {
+            fn(state->value, state->error);
+        }
+    }
+
+    std::shared_ptr<state_t> state;
+};
+
+
+
+
+//=============================================================================
+namespace crt {
+    template<> struct type_info<pending>
+    {
+        static const char* name() { return "pending"; }
+        static expression to_table(const pending&) { return expression(); }
+    };
+}
+
+
+/**
+ * If the expression holds a pending, wait for it and return its value, with
+ * the expression's key. Otherwise return the expression.
+ */
+crt::expression crt::await(expression e)
+{
+    if (auto p = pending::of(e))
+    {
+        return p->get().keyed(e.key());
+    }
+    return e;
+}
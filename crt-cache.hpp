@@ -0,0 +1,426 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "crt-expr.hpp"
+#include "crt-context.hpp"
+#include "crt-algorithm.hpp"
+#include "crt-serial.hpp"
+
+
+
+
+//=============================================================================
+namespace crt {
+    class result_cache;
+
+    template <typename CallAdapter=call_adapter>
+    context resolve_cached(context rules, context prods, result_cache& cache, const CallAdapter& adapter=CallAdapter());
+}
+
+
+
+
+//=============================================================================
+/**
+ * A content-addressed store of products in a directory, like a build
+ * system's action cache. A rule's cache key is a hash of the rule
+ * expression, together with the digests of the products it references;
+ * both are 64-bit FNV-1a hashes of the binary snapshot encoding, so they are
+ * the same from one process to the next. Each cached product is a snapshot
+ * file named by its key.
+ *
+ * Functions cannot be written, so a function product is digested by its key
+ * alone: if the implementation of a function changes, use a new salt (or a
+ * new directory). Products holding user_data are cached if their type_info
+ * has serialize and deserialize hooks, and the type is registered with
+ * add_type; other products, and the rules that reference them, are
+ * recomputed as usual.
+ */
+class crt::result_cache
+{
+public:
+
+
+    //=========================================================================
+    /**
+     * Use the given directory, creating it if needed. The salt is mixed into
+     * every key. Throws std::runtime_error if the directory cannot be made.
+     */
+    result_cache(std::string directory, std::string salt="")
+    : directory(std::move(directory))
+    , salt(fnv1a(salt, offset_basis))
+    {
+        if (::mkdir(this->directory.data(), 0777) != 0 && errno != EEXIST)
+        {
+            throw std::runtime_error("result_cache: cannot create " + this->directory);
+        }
+    }
+
+    result_cache(const result_cache&) = delete;
+    result_cache& operator=(const result_cache&) = delete;
+
+
+    /**
+     * Allow cached user_data of type T to be read back.
+     */
+    template<typename T>
+    result_cache& add_type()
+    {
+        readers.push_back([] (snapshot_reader& r) { r.add_type<T>(); });
+        return *this;
+    }
+
+
+    /**
+     * Return a stable digest of a product, or zero if it cannot be encoded.
+     */
+    std::uint64_t digest(const expression& product) const
+    {
+        if (product.has_type(data_type::function))
+        {
+            return fnv1a("function " + product.key().str(), salt) | 1;
+        }
+        if (! encodable(product))
+        {
+            return 0;
+        }
+        try {
+            auto writer = snapshot_writer();
+            writer.write(product);
+            return fnv1a(writer.str(), salt) | 1;
+        }
+        catch (const snapshot_error&)
+        {
+            return 0;
+        }
+    }
+
+
+    /**
+     * Return the cache key for a rule whose inputs have the given digests,
+     * in the order of their keys' strings, or zero if any of them is zero.
+     */
+    std::uint64_t key_of(const expression& rule, const std::vector<std::uint64_t>& inputs) const
+    {
+        auto h = digest(rule);
+
+        for (auto d : inputs)
+        {
+            if (d == 0 || h == 0)
+            {
+                return 0;
+            }
+            h = fnv1a(std::string(reinterpret_cast<const char*>(&d), sizeof(d)), h);
+        }
+        return h;
+    }
+
+
+    /**
+     * Look up a product by key, returning true and setting product if it is
+     * in the cache. Unreadable entries count as misses.
+     */
+    bool load(std::uint64_t key, expression& product) const
+    {
+        auto inf = std::ifstream(path_of(key), std::ios::binary);
+
+        if (! inf)
+        {
+            ++num_misses;
+            return false;
+        }
+
+        auto bytes = std::string(std::istreambuf_iterator<char>(inf), std::istreambuf_iterator<char>());
+
+        try {
+            auto reader = snapshot_reader(bytes.data(), bytes.data() + bytes.size());
+
+            for (const auto& configure : readers)
+            {
+                configure(reader);
+            }
+            product = reader.read_expression();
+            ++num_hits;
+            return true;
+        }
+        catch (const snapshot_error&)
+        {
+            ++num_misses;
+            return false;
+        }
+    }
+
+
+    /**
+     * Write a product under the given key, returning false (and writing
+     * nothing) if it cannot be encoded exactly or the file cannot be
+     * written. The file is written under a temporary name, unique to this
+     * process and write, and then renamed, so that readers (in this process
+     * or others sharing the directory) never see a partial entry.
+     */
+    bool store(std::uint64_t key, const expression& product) const
+    {
+        if (! encodable(product))
+        {
+            return false;
+        }
+        try {
+            auto writer = snapshot_writer();
+            writer.write(product);
+
+            auto path = path_of(key);
+            auto temp = path + ".tmp" + std::to_string(::getpid()) + "-" + std::to_string(++num_writes);
+            writer.save(temp);
+
+            if (std::rename(temp.data(), path.data()) != 0)
+            {
+                std::remove(temp.data());
+                return false;
+            }
+            return true;
+        }
+        catch (const snapshot_error&)
+        {
+            return false;
+        }
+    }
+
+    std::size_t hits()   const { return num_hits; }
+    std::size_t misses() const { return num_misses; }
+
+
+private:
+    //=========================================================================
+    static const std::uint64_t offset_basis = 14695981039346656037ull;
+
+    /**
+     * Return true if the expression would be read back as itself: that is,
+     * it holds no functions, and no user_data without a serialize hook
+     * (which snapshot_writer would write as its to_table expression).
+     */
+    static bool encodable(const expression& e)
+    {
+        auto bytes = std::string();
+
+        switch (e.dtype())
+        {
+            case data_type::function : return false;
+            case data_type::data     : return ! e.get_data() || e.get_data()->serialize(bytes);
+            case data_type::table:
+                for (const auto& part : e)
+                {
+                    if (! encodable(*part))
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            default: return true;
+        }
+    }
+
+    static std::uint64_t fnv1a(const std::string& bytes, std::uint64_t h)
+    {
+        for (auto c : bytes)
+        {
+            h = (h ^ std::uint8_t(c)) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    std::string path_of(std::uint64_t key) const
+    {
+        char name[17];
+        std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+        return directory + "/" + name + ".crtb";
+    }
+
+    std::string directory;
+    std::uint64_t salt;
+    std::vector<std::function<void(snapshot_reader&)>> readers;
+    mutable std::atomic<std::size_t> num_hits{0};
+    mutable std::atomic<std::size_t> num_misses{0};
+    mutable std::atomic<std::size_t> num_writes{0};
+};
+
+
+
+
+//=============================================================================
+/**
+ * Return the products (prods) extended by resolving every rule that can be
+ * resolved, like resolve_full, but taking the product of each rule from the
+ * cache when its key is there, and adding the products it computes. The
+ * products given in prods (typically functions) are digested as inputs too.
+ */
+template <typename CallAdapter>
+crt::context crt::resolve_cached(context rules, context prods, result_cache& cache, const CallAdapter& adapter)
+{
+    auto digests = std::unordered_map<ident, std::uint64_t>();
+
+    auto digest_of = [&] (ident k)
+    {
+        auto d = digests.find(k);
+        return d != digests.end() ? d->second : (digests[k] = cache.digest(prods.at(k)));
+    };
+
+    for (const auto& key : rules.sorted_keys())
+    {
+        const auto& e = rules.at(key);
+
+        if (prods.count(key) || e.symbols().empty() || ! contains(prods, e.symbols()))
+        {
+            prods = resolve_only(e, std::move(prods), adapter);
+            continue;
+        }
+
+        auto inputs = std::vector<ident>(e.symbols().begin(), e.symbols().end());
+        auto digest = std::vector<std::uint64_t>();
+
+        std::sort(inputs.begin(), inputs.end(), [] (const ident& a, const ident& b)
+        {
+            return a.str() < b.str();
+        });
+
+        for (const auto& s : inputs)
+        {
+            digest.push_back(digest_of(s));
+        }
+
+        auto k = cache.key_of(e, digest);
+        auto p = expression();
+
+        if (k && cache.load(k, p))
+        {
+            prods = std::move(prods).insert(p.keyed(key));
+            continue;
+        }
+
+        prods = resolve_only(e, std::move(prods), adapter);
+
+        if (k && prods.count(key))
+        {
+            cache.store(k, prods.at(key));
+        }
+    }
+    return prods;
+}
+
+
+
+
+//=============================================================================
+#ifdef TEST_CACHE
+#include <cstdlib>
+#include "catch.hpp"
+
+
+
+
+//=============================================================================
+struct cache_point
+{
+    int x;
+};
+
+namespace crt {
+    template<> struct type_info<cache_point>
+    {
+        static const char* name() { return "cache_point"; }
+        static expression to_table(const cache_point& p) { return {p.x}; }
+    };
+}
+
+
+
+
+//=============================================================================
+TEST_CASE("resolve_cached reuses products across caches on disk", "[cache]")
+{
+    using namespace crt;
+
+    char dir[] = "/tmp/crt-cache-XXXXXX";
+    REQUIRE(::mkdtemp(dir) != nullptr);
+
+    auto calls = std::make_shared<int>(0);
+    auto add = [calls] (expression e)
+    {
+        ++*calls;
+        return expression(e.first().get_i32() + e.second().get_i32());
+    };
+    auto funcs = context().insert(expression(func_t(add)).keyed("add"));
+    auto rules = context::parse("(a=1 b=(add a 1) c=(add b b) d=(add c a) s='x' t=(add s s))");
+
+    {
+        result_cache cache(dir);
+        auto prods = resolve_cached(rules, funcs, cache);
+        REQUIRE(prods.at("d").get_i32() == 5);
+        REQUIRE(*calls == 4);
+        REQUIRE(cache.hits() == 0);
+    }
+    {
+        result_cache cache(dir);
+        auto prods = resolve_cached(rules, funcs, cache);
+        REQUIRE(prods.at("d").get_i32() == 5);
+        REQUIRE(prods.at("d").key() == ident("d"));
+        REQUIRE(*calls == 4);
+        REQUIRE(cache.hits() == 4);
+    }
+    {
+        result_cache cache(dir);
+        auto prods = resolve_cached(rules.insert(expression(2).keyed("a")), funcs, cache);
+        REQUIRE(prods.at("d").get_i32() == 8);
+        REQUIRE(prods.at("t").get_i32() == 0);
+        REQUIRE(*calls == 7);
+        REQUIRE(cache.hits() == 1); // t did not change
+    }
+    {
+        result_cache cache(dir, "add-v2");
+        resolve_cached(rules, funcs, cache);
+        REQUIRE(*calls == 11);
+    }
+    std::system((std::string("rm -r ") + dir).data());
+}
+
+TEST_CASE("resolve_cached recomputes user_data it cannot read back", "[cache]")
+{
+    using namespace crt;
+
+    char dir[] = "/tmp/crt-cache-XXXXXX";
+    REQUIRE(::mkdtemp(dir) != nullptr);
+
+    auto calls = std::make_shared<int>(0);
+    auto make = [calls] (expression e)
+    {
+        ++*calls;
+        return expression(make_data(cache_point{e.first().get_i32()}));
+    };
+    auto funcs = context().insert(expression(func_t(make)).keyed("make"));
+    auto rules = context::parse("(a=(make 1) b=(make 2))");
+
+    for (int run = 0; run < 2; ++run)
+    {
+        result_cache cache(dir);
+        auto prods = resolve_cached(rules, funcs, cache);
+        REQUIRE(prods.at("a").get_data()->type_name() == std::string("cache_point"));
+        REQUIRE(cache.hits() == 0);
+        REQUIRE(cache.digest(prods.at("a")) == 0);
+        REQUIRE_FALSE(cache.store(1, prods.at("a")));
+    }
+    REQUIRE(*calls == 4);
+    std::system((std::string("rm -r ") + dir).data());
+}
+
+#endif // TEST_CACHE
@@ -1,6 +1,13 @@
 #pragma once
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
 #include "crt-expr.hpp"
+#include "immer/flex_vector.hpp"
+#include "immer/flex_vector_transient.hpp"
 #include "immer/map.hpp"
+#include "immer/map_transient.hpp"
+#include "immer/set_transient.hpp"
 
 
 
@@ -15,7 +22,7 @@ namespace crt {
 
 //=============================================================================
 /**
- * This class extends an immutable map<std::string, crt::expression> to serve
+ * This class extends an immutable map<crt::ident, crt::expression> to serve
  * as a dependency graph, providing methods to quickly retrieve dependencies
  * between the contained expressions. In particular, it makes the
  * determination of downstream rules (the ones directly or indirectly
@@ -24,6 +31,10 @@ namespace crt {
  * case, the insertion of a new rule is O(N+S) in the number N of existing
  * items, and the number of symbols (incoming edge count) S immediately
  * referenced by the inserted item. Replacement of existing rules is O(S).
+ *
+ * The keys are also kept in a persistent vector sorted by name, so that a
+ * user interface can find the key at a row, or the row of a key, in
+ * O(log^2 N), and list a window of rows without visiting the whole context.
  */
 class crt::context
 {
@@ -31,9 +42,10 @@ public:
 
 
     //=========================================================================
-    using map_t = immer::map<std::string, crt::expression>;
-    using set_t = immer::set<std::string>;
-    using dag_t = immer::map<std::string, set_t>;
+    using map_t = immer::map<crt::ident, crt::expression, std::hash<crt::ident>, std::equal_to<crt::ident>, crt::memory_policy>;
+    using set_t = crt::symbols_t;
+    using dag_t = immer::map<crt::ident, set_t, std::hash<crt::ident>, std::equal_to<crt::ident>, crt::memory_policy>;
+    using order_t = immer::flex_vector<crt::ident, crt::memory_policy>;
 
 
     /**
@@ -41,19 +53,104 @@ public:
      */
     static context parse(std::string source)
     {
-        auto c = context();
+        return parse(source.data(), source.data() + source.size());
+    }
+
+
+    /**
+     * Parse a context from the characters in [first, last). Rules are
+     * inserted as they are read, so the whole document is never held in
+     * memory as a single expression.
+     */
+    static context parse(const char* first, const char* last)
+    {
+        auto b = builder();
 
-        for (const auto& e : crt::parse(source))
+        parser::parse_items(first, last, [&b] (expression e)
         {
-            if (! e->key().empty())
+            if (! e.key().empty())
             {
-                c = std::move(c).insert(e);
+                b.insert(std::move(e));
             }
-        }
-        return c;
+        });
+        return std::move(b).build();
     }
 
 
+    //=========================================================================
+    /**
+     * Accumulates rules into transient maps, and builds a context from them
+     * in one step. The edge maps are computed once when build is called,
+     * rather than updated on each insertion, and the whole batch is checked
+     * for dependency cycles with a single topological sort. Later insertions
+     * replace earlier ones with the same key.
+     */
+    class builder
+    {
+    public:
+        builder() {}
+
+        /**
+         * Start from the rules in an existing context.
+         */
+        builder(const context& base) : items(base.items.transient()) {}
+
+        void insert(expression e)
+        {
+            auto k = e.key();
+            items.set(std::move(k), std::move(e));
+        }
+
+        std::size_t size() const
+        {
+            return items.size();
+        }
+
+        /**
+         * Return a context with the inserted rules. std::invalid_argument is
+         * thrown if the rules contain a dependency cycle. This is O(N+E) in
+         * the number of rules N and edges E.
+         */
+        context build()
+        {
+            auto result_items = items.persistent();
+            auto in = dag_t().transient();
+            auto out = dag_t().transient();
+            auto edges = std::unordered_map<ident, set_t::transient_type>();
+
+            for (const auto& item : result_items)
+            {
+                in.set(item.first, item.second.symbols());
+
+                for (const auto& s : item.second.symbols())
+                {
+                    if (result_items.count(s))
+                    {
+                        edges[s].insert(item.first);
+                    }
+                }
+            }
+
+            for (const auto& item : result_items)
+            {
+                auto e = edges.find(item.first);
+                out.set(item.first, e == edges.end() ? set_t() : e->second.persistent());
+            }
+
+            auto result = context(result_items, in.persistent(), out.persistent());
+
+            if (result.sorted_keys().size() != result.size())
+            {
+                throw std::invalid_argument("would create dependency cycle");
+            }
+            return result;
+        }
+
+    private:
+        map_t::transient_type items = map_t().transient();
+    };
+
+
     /**
      * Default constructor
      */
@@ -77,7 +174,7 @@ public:
      * name. std::invalid_argument is thrown if the addition would form a
      * dependency cycle.
      */
-    context insert(crt::expression e) const
+    context insert(crt::expression e) const &
     {
         if (cyclic(e))
         {
@@ -90,22 +187,64 @@ public:
             items.set(k, e),
             incoming.set(k, e.symbols()),
             add_through(remove_through(outgoing, get(k)), e).set(k, get_outgoing(k)),
+            items.count(k) ? order : order.insert(rank(k), k),
         };
     }
 
 
+    /**
+     * Like insert above, but updating the maps of this context in place
+     * where they are not shared.
+     */
+    context insert(crt::expression e) &&
+    {
+        if (cyclic(e))
+        {
+            throw std::invalid_argument("would create dependency cycle");
+        }
+
+        auto k = e.key();
+        auto out = get_outgoing(k);
+        auto old = get(k);
+
+        if (! items.count(k))
+        {
+            order = std::move(order).insert(rank(k), k);
+        }
+        incoming = std::move(incoming).set(k, e.symbols());
+        outgoing = add_through(remove_through(std::move(outgoing), old), e).set(k, std::move(out));
+        items = std::move(items).set(k, std::move(e));
+        return std::move(*this);
+    }
+
+
     /**
      * Erase the item with the given key, if it exists.
      */
-    context erase(std::string k) const
+    context erase(ident k) const &
     {
         return {
             items.erase(k),
             incoming.erase(k),
             remove_through(outgoing, get(k)).erase(k),
+            items.count(k) ? order.erase(rank(k)) : order,
         };
     }
 
+    context erase(ident k) &&
+    {
+        auto old = get(k);
+
+        if (items.count(k))
+        {
+            order = std::move(order).erase(rank(k));
+        }
+        incoming = std::move(incoming).erase(k);
+        outgoing = remove_through(std::move(outgoing), old).erase(k);
+        items = std::move(items).erase(k);
+        return std::move(*this);
+    }
+
 
     /**
      * Erase any item whose key is in the given set.
@@ -126,7 +265,7 @@ public:
      * Return the incoming edges for the given rule. An empty set is returned
      * if the key does not exist in the graph.
      */
-    set_t get_incoming(std::string key) const
+    set_t get_incoming(ident key) const
     {
         if (items.count(key))
         {
@@ -142,7 +281,7 @@ public:
      * the graph name it as a dependency. If it does exist in the graph, this
      * is a fast operation because the outgoing edges are kept up-to-date.
      */
-    set_t get_outgoing(std::string key) const
+    set_t get_outgoing(ident key) const
     {
         if (items.count(key))
         {
@@ -163,7 +302,7 @@ public:
 
 
     /** Return 1 if the given key is in the map. */
-    auto count(std::string key) const
+    auto count(ident key) const
     {
         return items.count(key);
     }
@@ -180,6 +319,11 @@ public:
      */
     bool cyclic(expression e) const
     {
+        if (e.symbols().empty())
+        {
+            return false;
+        }
+
         auto dependents = referencing(e.key());
 
         for (const auto& s : e.symbols())
@@ -195,20 +339,57 @@ public:
 
     /**
      * Return the names of items in this context that reference (directly or
-     * indirectly) the given key.
+     * indirectly) the given key. The key itself is included. The traversal
+     * uses an explicit stack and visits each downstream item once, so it is
+     * O(N+E) in the size of the downstream graph, even when many paths lead
+     * to the same item.
      */
-    set_t referencing(std::string key) const
+    set_t referencing(ident key) const
     {
-        auto result = get_outgoing(key);
+        auto result = set_t().insert(key);
+        auto stack = std::vector<ident>{key};
 
-        for (const auto& k : get_outgoing(key))
+        while (! stack.empty())
         {
-            for (const auto& m : referencing(k))
+            auto k = std::move(stack.back());
+            stack.pop_back();
+
+            for (const auto& m : get_outgoing(k))
             {
-                result = std::move(result).insert(m);
+                if (! result.count(m))
+                {
+                    result = std::move(result).insert(m);
+                    stack.push_back(m);
+                }
             }
         }
-        return result.insert(key);
+        return result;
+    }
+
+
+    /**
+     * Return the keys of this context in topological order: each rule comes
+     * after every rule it references. Symbols that do not name a rule in the
+     * context impose no ordering. This is Kahn's algorithm run over the
+     * maintained incoming and outgoing edges, and is O(N+E) in the number of
+     * rules N and edges E.
+     */
+    std::vector<ident> sorted_keys() const
+    {
+        return sorted_keys(items, [] (const auto& item) { return item.first; });
+    }
+
+
+    /**
+     * Return the given keys in topological order, considering only the edges
+     * between them. Keys that are not in this context are left out. This is
+     * O(K+E) in the number of keys K and the edges E among them.
+     */
+    std::vector<ident> sorted_keys(const set_t& keys) const
+    {
+        auto key_of = [] (const ident& k) { return k; };
+        auto in_keys = [&keys] (const ident& k) { return keys.count(k) != 0; };
+        return sorted_keys(keys, key_of, in_keys);
     }
 
 
@@ -237,7 +418,7 @@ public:
      * Return a const reference to the expression at the given key. Throw
      * std::out_of_range if it does not exist at all.
      */
-    const crt::expression& at(std::string k) const
+    const crt::expression& at(ident k) const
     {
         return items.at(k);
     }
@@ -247,29 +428,41 @@ public:
      * Return the expression at the given key if it exists, or an empty one
      * with that key otherwise.
      */
-    crt::expression get(std::string k) const
+    crt::expression get(ident k) const
     {
         return items.count(k) ? items.at(k) : crt::expression().keyed(k);
     }
 
 
     /**
-     * Return the key at the given linear index. The items are not sorted, but
-     * if you are displaying this context somewhere using its internal
-     * ordering, this method will find the key at the displayed index. Note
-     * the search is O(N) in the context size. Returns an empty string if the
-     * index is larger than or equal to the number of items.
+     * Return the key at the given index in the order of key names, or an
+     * empty key if the index is larger than or equal to the number of items.
+     * This is O(log N).
      */
-    std::string nth_key(std::size_t index) const
+    ident nth_key(std::size_t index) const
     {
-        for (const auto& item : items)
-        {
-            if (! index--)
-            {
-                return item.first;
-            }
-        }
-        return std::string();
+        return index < order.size() ? order[index] : ident();
+    }
+
+
+    /**
+     * Return the index of the given key in the order of key names, or, if
+     * it is not in the context, the index at which it would be inserted.
+     * This is O(log^2 N).
+     */
+    std::size_t rank(ident key) const
+    {
+        return std::lower_bound(order.begin(), order.end(), key) - order.begin();
+    }
+
+
+    /**
+     * Return up to count keys in the order of key names, starting at the
+     * given index, for example the rows visible in a scrolled list.
+     */
+    order_t keys(std::size_t first=0, std::size_t count=std::size_t(-1)) const
+    {
+        return order.drop(first).take(count);
     }
 
 
@@ -278,13 +471,18 @@ public:
      */
     expression expr() const
     {
-        auto e = crt::expression();
+        if (items.size() == 0)
+        {
+            return crt::expression();
+        }
 
-        for (auto item : items)
+        auto parts = cont_t().transient();
+
+        for (const auto& item : items)
         {
-            e = std::move(e).append(item.second);
+            parts.push_back(item.second);
         }
-        return e;
+        return parts.persistent();
     }
 
 
@@ -296,6 +494,30 @@ public:
     : items(items)
     , incoming(incoming)
     , outgoing(outgoing)
+    {
+        auto sorted = std::vector<ident>();
+        sorted.reserve(this->items.size());
+
+        for (const auto& item : this->items)
+        {
+            sorted.push_back(item.first);
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        auto o = order_t().transient();
+
+        for (const auto& k : sorted)
+        {
+            o.push_back(k);
+        }
+        order = o.persistent();
+    }
+
+    context(map_t items, dag_t incoming, dag_t outgoing, order_t order)
+    : items(std::move(items))
+    , incoming(std::move(incoming))
+    , outgoing(std::move(outgoing))
+    , order(std::move(order))
     {
     }
 
@@ -303,7 +525,7 @@ public:
     /**
      * o[s] -= e.key for s in e.symbols if s in o
      */
-    static dag_t remove_through(dag_t o, expression e)
+    static dag_t remove_through(dag_t o, const expression& e)
     {
         for (const auto& s : e.symbols())
         {
@@ -319,7 +541,7 @@ public:
     /**
      * o[s] += e.key for s in e.symbols if s in o
      */
-    static dag_t add_through(dag_t o, expression e)
+    static dag_t add_through(dag_t o, const expression& e)
     {
         for (const auto& s : e.symbols())
         {
@@ -332,9 +554,66 @@ public:
     }
 
 
+    /**
+     * Kahn's algorithm over the keys in a range, restricted to the keys for
+     * which the member predicate is true (the range is assumed to hold only
+     * such keys, and they need not all be in this context).
+     */
+    template<typename Range, typename KeyOf, typename Member>
+    std::vector<ident> sorted_keys(const Range& range, KeyOf key_of, Member member) const
+    {
+        auto result = std::vector<ident>();
+        auto degree = std::unordered_map<ident, std::size_t>();
+
+        for (const auto& r : range)
+        {
+            auto key = key_of(r);
+
+            if (! items.count(key))
+            {
+                continue;
+            }
+
+            std::size_t n = 0;
+
+            for (const auto& s : incoming.at(key))
+            {
+                n += items.count(s) && member(s);
+            }
+            if (n == 0)
+            {
+                result.push_back(key);
+            }
+            else
+            {
+                degree[key] = n;
+            }
+        }
+
+        for (std::size_t i = 0; i < result.size(); ++i)
+        {
+            for (const auto& k : outgoing.at(result[i]))
+            {
+                if (member(k) && --degree[k] == 0)
+                {
+                    result.push_back(k);
+                }
+            }
+        }
+        return result;
+    }
+
+    template<typename Range, typename KeyOf>
+    std::vector<ident> sorted_keys(const Range& range, KeyOf key_of) const
+    {
+        return sorted_keys(range, key_of, [] (const ident&) { return true; });
+    }
+
+
     map_t items;
     dag_t incoming;
     dag_t outgoing;
+    order_t order;
 };
 
 
@@ -392,6 +671,92 @@ TEST_CASE("context maintains DAG correctly", "[context]")
         REQUIRE(c.get_outgoing("D") == context::set_t().insert("C"));
         REQUIRE(c.get_outgoing("E") == context::set_t().insert("D"));
     }
+    SECTION("referencing visits shared downstream items once")
+    {
+        auto source = std::string("(x0=1");
+
+        for (int i = 1; i <= 48; ++i)
+        {
+            auto n = std::to_string(i);
+            auto m = std::to_string(i - 1);
+            source += " l" + n + "=x" + m + " r" + n + "=x" + m + " x" + n + "=(l" + n + " r" + n + ")";
+        }
+        auto c = context::parse(source + ")");
+        REQUIRE(c.referencing("x0").size() == 1 + 3 * 48);
+        REQUIRE(c.referencing("x47").size() == 1 + 3);
+        REQUIRE(c.cyclic(symbol("x48").keyed("x0")));
+        REQUIRE_FALSE(c.cyclic(symbol("x0").keyed("x48")));
+    }
+    SECTION("sorted keys put each rule after its dependencies")
+    {
+        auto c = context::parse("(A=(B C) B=(C D) C=D D=1 E=F)");
+        auto k = c.sorted_keys();
+        auto position = [&k] (ident key)
+        {
+            return std::find(k.begin(), k.end(), key) - k.begin();
+        };
+        REQUIRE(k.size() == 5);
+        REQUIRE(position("D") < position("C"));
+        REQUIRE(position("C") < position("B"));
+        REQUIRE(position("B") < position("A"));
+    }
+    SECTION("rvalue insert and erase agree with the const versions")
+    {
+        auto c = context::parse("(A=(B C) B=(C D) C=D D=1)");
+        auto e = symbol("A").keyed("D");
+        REQUIRE_THROWS_AS(context(c).insert(e), std::invalid_argument);
+
+        auto d = context(c).insert(expression(2).keyed("D")).erase("B");
+        auto f = c.insert(expression(2).keyed("D"));
+        f = f.erase("B");
+        REQUIRE(d == f);
+        REQUIRE(d.get_outgoing("C") == f.get_outgoing("C"));
+        REQUIRE(d.get_outgoing("D") == f.get_outgoing("D"));
+        REQUIRE(c.size() == 4);
+    }
+    SECTION("the builder agrees with repeated insertion")
+    {
+        auto rules = parse("(A=(B C) B=(C D) C=D D=1 E=F)");
+        auto c = context();
+        auto b = context::builder();
+
+        for (const auto& e : rules)
+        {
+            c = c.insert(*e);
+            b.insert(*e);
+        }
+        auto d = b.build();
+
+        for (auto key : {"A", "B", "C", "D", "E", "F"})
+        {
+            REQUIRE(d.get_incoming(key) == c.get_incoming(key));
+            REQUIRE(d.get_outgoing(key) == c.get_outgoing(key));
+        }
+        REQUIRE(d == c);
+    }
+    SECTION("the builder rejects a batch containing a cycle")
+    {
+        auto b = context::builder(context::parse("(A=B B=C)"));
+        b.insert(symbol("A").keyed("C"));
+        REQUIRE_THROWS_AS(b.build(), std::invalid_argument);
+        REQUIRE_THROWS_AS(context::parse("(A=A)"), std::invalid_argument);
+    }
+    SECTION("keys are indexed in order of their names")
+    {
+        auto c = context::parse("(d=1 b=2 a=3 c=4)");
+        REQUIRE(c.nth_key(0) == ident("a"));
+        REQUIRE(c.nth_key(3) == ident("d"));
+        REQUIRE(c.nth_key(4).empty());
+        REQUIRE(c.rank("c") == 2);
+
+        auto d = c.insert(expression(5).keyed("bb")).erase("a");
+        auto e = context(c).insert(expression(5).keyed("bb")).erase("a").insert(expression(6).keyed("c"));
+        REQUIRE(d.keys() == context::order_t{"b", "bb", "c", "d"});
+        REQUIRE(e.keys() == d.keys());
+        REQUIRE(d.keys(1, 2) == context::order_t{"bb", "c"});
+        REQUIRE(d.keys(3, 10) == context::order_t{"d"});
+        REQUIRE(c.keys() == context::order_t{"a", "b", "c", "d"});
+    }
 }
 
 
@@ -0,0 +1,448 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "crt-expr.hpp"
+#include "crt-context.hpp"
+#include "crt-algorithm.hpp"
+#include "crt-serial.hpp"
+
+
+
+
+//=============================================================================
+namespace crt {
+    struct partition_t;
+    class transport;
+    class partition_node;
+    inline std::vector<partition_t> partition(const context& rules, std::size_t num_partitions);
+}
+
+
+
+
+//=============================================================================
+/**
+ * One part of a context split across processes by crt::partition. Rules
+ * that reference no symbols (constants and functions) are copied into every
+ * partition that uses them, rather than being owned by one; those that no
+ * rule uses go to the least loaded partition. Imports are the keys this
+ * partition needs from others, and exports map each key it owns to the
+ * partitions that need it.
+ */
+struct crt::partition_t
+{
+    context rules;
+    context::set_t imports;
+    std::unordered_map<ident, std::vector<std::size_t>> exports;
+};
+
+
+
+
+//=============================================================================
+/**
+ * Delivers encoded products from one partition_node to another, for example
+ * over a socket or a message queue. The receiving side should pass the bytes
+ * to partition_node::receive of the node for that partition. send may be
+ * called from any thread that calls into a node, but never while the node's
+ * lock is held, so a transport may deliver synchronously.
+ */
+class crt::transport
+{
+public:
+    virtual ~transport() {}
+    virtual void send(std::size_t partition, std::string bytes) = 0;
+};
+
+
+
+
+//=============================================================================
+/**
+ * Split the rules into the given number of partitions, keeping rules that
+ * depend on each other together where possible. This is a single greedy
+ * pass in topological order: each rule goes to the partition owning most of
+ * its dependencies, discounted by how full that partition is, so that the
+ * partitions stay within about 10% of the same size. It is O(N (P + S)) for
+ * N rules, P partitions, and S symbols per rule.
+ */
+std::vector<crt::partition_t> crt::partition(const context& rules, std::size_t num_partitions)
+{
+    auto n = std::max(num_partitions, std::size_t(1));
+    auto owner = std::unordered_map<ident, std::size_t>();
+    auto load = std::vector<std::size_t>(n, 0);
+    auto score = std::vector<double>(n, 0.0);
+    auto replicated = [&rules] (const ident& k) { return rules.at(k).symbols().empty(); };
+
+    std::size_t owned = 0;
+
+    for (const auto& item : rules)
+    {
+        owned += ! item.second.symbols().empty();
+    }
+
+    auto capacity = 1.1 * double(owned) / double(n) + 1.0;
+
+    for (const auto& key : rules.sorted_keys())
+    {
+        if (replicated(key))
+        {
+            continue;
+        }
+
+        std::fill(score.begin(), score.end(), 0.0);
+
+        for (const auto& s : rules.get_incoming(key))
+        {
+            auto o = owner.find(s);
+
+            if (o != owner.end())
+            {
+                score[o->second] += 1.0;
+            }
+        }
+
+        std::size_t best = 0;
+        double best_score = -1.0;
+
+        for (std::size_t p = 0; p < n; ++p)
+        {
+            if (load[p] + 1 > capacity)
+            {
+                continue;
+            }
+
+            auto s = (score[p] + 1.0) * (1.0 - double(load[p]) / capacity);
+
+            if (s > best_score || (s == best_score && load[p] < load[best]))
+            {
+                best = p;
+                best_score = s;
+            }
+        }
+        owner[key] = best;
+        load[best] += 1;
+    }
+
+    auto builders = std::vector<context::builder>(n);
+    auto result = std::vector<partition_t>(n);
+    auto used = std::unordered_set<ident>();
+
+    for (const auto& o : owner)
+    {
+        auto p = o.second;
+        builders[p].insert(rules.at(o.first));
+
+        for (const auto& s : rules.get_incoming(o.first))
+        {
+            if (! rules.count(s))
+            {
+                continue;
+            }
+            else if (replicated(s))
+            {
+                builders[p].insert(rules.at(s));
+                used.insert(s);
+            }
+            else if (owner.at(s) != p)
+            {
+                auto& dests = result[owner.at(s)].exports[s];
+                result[p].imports = std::move(result[p].imports).insert(s);
+
+                if (std::find(dests.begin(), dests.end(), p) == dests.end())
+                {
+                    dests.push_back(p);
+                }
+            }
+        }
+    }
+
+    for (const auto& key : rules.sorted_keys())
+    {
+        if (replicated(key) && ! used.count(key))
+        {
+            auto p = std::min_element(load.begin(), load.end()) - load.begin();
+            builders[p].insert(rules.at(key));
+            load[p] += 1;
+        }
+    }
+
+    for (std::size_t p = 0; p < n; ++p)
+    {
+        result[p].rules = builders[p].build();
+    }
+    return result;
+}
+
+
+
+
+//=============================================================================
+/**
+ * Resolves one partition of a context, exchanging boundary products with the
+ * other partitions through a transport. Call start once, and then receive
+ * with each message delivered for this partition; every call resolves what
+ * has become possible, and sends each newly resolved export to the
+ * partitions that need it, encoded as a binary snapshot holding a context of
+ * products. Functions cannot be sent, so they should be given to every node
+ * as base products (or as symbol-free rules, which partition copies). A node
+ * may be called from several threads.
+ */
+class crt::partition_node
+{
+public:
+
+
+    //=========================================================================
+    partition_node(partition_t part, context base, transport& net)
+    : part(std::move(part))
+    , prods(std::move(base))
+    , net(net)
+    {
+    }
+
+    partition_node(const partition_node&) = delete;
+    partition_node& operator=(const partition_node&) = delete;
+
+
+    /**
+     * Allow products holding user_data of type T to be received.
+     */
+    template<typename T>
+    partition_node& add_type()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        readers.push_back([] (snapshot_reader& r) { r.add_type<T>(); });
+        return *this;
+    }
+
+    void start()
+    {
+        send(step(context()));
+    }
+
+    void receive(const char* first, const char* last)
+    {
+        auto reader = snapshot_reader(first, last);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for (const auto& configure : readers)
+            {
+                configure(reader);
+            }
+        }
+        send(step(reader.read_context()));
+    }
+
+    void receive(const std::string& bytes)
+    {
+        receive(bytes.data(), bytes.data() + bytes.size());
+    }
+
+
+    /**
+     * Return true if every rule in this partition has a product.
+     */
+    bool complete() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for (const auto& item : part.rules)
+        {
+            if (! prods.count(item.first))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    context products() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return prods;
+    }
+
+    const partition_t& get_partition() const
+    {
+        return part;
+    }
+
+
+private:
+    //=========================================================================
+    using messages_t = std::vector<std::pair<std::size_t, std::string>>;
+
+
+    /**
+     * Add the received products, resolve, and encode the exports that are
+     * newly available.
+     */
+    messages_t step(context received)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for (const auto& item : received)
+        {
+            if (part.imports.count(item.first) && ! prods.count(item.first))
+            {
+                prods = std::move(prods).insert(item.second);
+            }
+        }
+        prods = resolve_full(part.rules, std::move(prods));
+
+        auto batches = std::unordered_map<std::size_t, context::builder>();
+
+        for (const auto& e : part.exports)
+        {
+            if (prods.count(e.first) && ! sent.count(e.first))
+            {
+                sent = std::move(sent).insert(e.first);
+
+                for (auto p : e.second)
+                {
+                    batches[p].insert(prods.at(e.first));
+                }
+            }
+        }
+
+        auto messages = messages_t();
+
+        for (auto& batch : batches)
+        {
+            auto writer = snapshot_writer();
+            writer.write(batch.second.build());
+            messages.emplace_back(batch.first, writer.str());
+        }
+        return messages;
+    }
+
+    void send(messages_t messages)
+    {
+        for (auto& m : messages)
+        {
+            net.send(m.first, std::move(m.second));
+        }
+    }
+
+    partition_t part;
+    context prods;
+    context::set_t sent;
+    transport& net;
+    std::vector<std::function<void(snapshot_reader&)>> readers;
+    mutable std::mutex mutex;
+};
+
+
+
+
+//=============================================================================
+#ifdef TEST_DISTRIBUTED
+#include <deque>
+#include <memory>
+#include "catch.hpp"
+
+
+
+
+//=============================================================================
+TEST_CASE("partitioned contexts resolve by exchanging products", "[distributed]")
+{
+    using namespace crt;
+
+    struct queue_transport : transport
+    {
+        void send(std::size_t partition, std::string bytes) override
+        {
+            queue.emplace_back(partition, std::move(bytes));
+        }
+        std::deque<std::pair<std::size_t, std::string>> queue;
+    };
+
+    auto add = [] (expression e)
+    {
+        int total = 0;
+
+        for (const auto& part : e)
+        {
+            total += part->get_i32();
+        }
+        return expression(total);
+    };
+    auto base = context().insert(expression(func_t(add)).keyed("add"));
+
+    SECTION("independent components are not cut")
+    {
+        auto rules = context::parse("(a=1 b=(add a 1) c=(add b 1) x=2 y=(add x 1) z=(add y 1))");
+        auto parts = partition(rules, 2);
+        REQUIRE(parts.size() == 2);
+        REQUIRE(parts[0].imports.size() + parts[1].imports.size() == 0);
+        REQUIRE(parts[0].rules.size() + parts[1].rules.size() == 6);
+    }
+    SECTION("the partitions together cover every rule")
+    {
+        auto rules = context::parse("(a=1 b=2 c=(x y) d=(add a 1) e='unused')");
+        auto parts = partition(rules, 2);
+        auto covered = context::set_t();
+
+        for (const auto& p : parts)
+        {
+            for (const auto& item : p.rules)
+            {
+                covered = std::move(covered).insert(item.first);
+            }
+        }
+        REQUIRE(covered.size() == rules.size());
+        REQUIRE(partition(context::parse("(a=1 b=2 c=3)"), 2)[1].rules.size() > 0);
+    }
+    SECTION("a chain split across nodes resolves like resolve_full")
+    {
+        auto source = std::string("(x0=1");
+
+        for (int i = 1; i < 40; ++i)
+        {
+            source += " x" + std::to_string(i) + "=(add x" + std::to_string(i / 2) + " x" + std::to_string(i - 1) + ")";
+        }
+        auto rules = context::parse(source + ")");
+        auto parts = partition(rules, 3);
+        auto net = queue_transport();
+        auto nodes = std::vector<std::unique_ptr<partition_node>>();
+
+        for (const auto& p : parts)
+        {
+            REQUIRE(p.rules.size() <= 16);
+            nodes.emplace_back(new partition_node(p, base, net));
+        }
+        for (auto& node : nodes)
+        {
+            node->start();
+        }
+        while (! net.queue.empty())
+        {
+            auto m = std::move(net.queue.front());
+            net.queue.pop_front();
+            nodes[m.first]->receive(m.second);
+        }
+
+        auto expected = resolve_full(rules, base);
+
+        for (auto& node : nodes)
+        {
+            REQUIRE(node->complete());
+
+            for (const auto& item : node->get_partition().rules)
+            {
+                REQUIRE(node->products().at(item.first) == expected.at(item.first));
+            }
+        }
+    }
+}
+
+#endif // TEST_DISTRIBUTED
@@ -1,8 +1,41 @@
 #pragma once
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 #include <immer/flex_vector.hpp>
 #include <immer/flex_vector_transient.hpp>
 #include <immer/set.hpp>
 #include <immer/box.hpp>
+#include <immer/memory_policy.hpp>
+
+
+
+
+/**
+ * The immer memory policy used for every persistent container in crt. It can
+ * be replaced at build time, for example with one using a different heap
+ * policy, by defining CRT_MEMORY_POLICY before the crt headers are included.
+ */
+#ifndef CRT_MEMORY_POLICY
+#define CRT_MEMORY_POLICY immer::default_memory_policy
+#endif
 
 
 
@@ -13,10 +46,17 @@ namespace crt
 
 
     //=========================================================================
+    class ident;
     class kernel;
     class parser;
     class expression;
     class call_adapter;
+    class memoizing_call_adapter;
+    class instrument;
+    class native_function;
+    struct native_call;
+    class hash_cons;
+    class snapshot_writer;
     enum class data_type { none, i32, f64, str, symbol, data, function, table };
 
 
@@ -39,21 +79,42 @@ namespace crt
          * cause the unparse method to recurse forever.
          */
         virtual expression to_table() const = 0;
+
+
+        /**
+         * Append a binary representation of this user_data to out and return
+         * true, or return false if it has none. Capsules forward this to
+         * type_info<T>::serialize, if that is defined.
+         */
+        virtual bool serialize(std::string&) const { return false; }
+
+
+        /**
+         * Return the approximate number of bytes held by this user_data, or
+         * zero if it is not known. Capsules forward this to
+         * type_info<T>::size_bytes, if that is defined, and otherwise return
+         * sizeof(T).
+         */
+        virtual std::size_t size_bytes() const { return 0; }
     };
 
 
     //=========================================================================
     using func_t = std::function<expression(expression)>;
     using data_t = std::shared_ptr<user_data>;
-    using cont_t = immer::flex_vector<immer::box<expression>>;
+    using memory_policy = CRT_MEMORY_POLICY;
+    template<typename T> using box_t = immer::box<T, memory_policy>;
+    using cont_t = immer::flex_vector<box_t<expression>, memory_policy>;
+    using symbols_t = immer::set<ident, std::hash<ident>, std::equal_to<ident>, memory_policy>;
 
 
     //=========================================================================
     template<typename T> struct capsule;
+    template<typename T> class pool_allocator;
     template<typename T> struct type_info;
     template<typename T> static data_t make_data(const T&);
     template<typename T> static func_t init();
-    static inline expression symbol(const std::string&);
+    static inline expression symbol(ident);
     static inline expression parse(const std::string&);
     static inline expression parse(const char*);
 
@@ -69,6 +130,95 @@ namespace crt
 
 
 
+//=============================================================================
+/**
+ * An interned string, used for symbols and keys. Each distinct string is
+ * stored once in a process-wide symbol table, and an ident is a pointer to
+ * that entry. Copying, hashing, and comparing idents for equality are
+ * therefore integer operations; strings are only involved when an ident is
+ * made from one (at the parse edge, or from a string-keyed lookup), or read
+ * back. Making an ident from a string hashes it and locks one shard of the
+ * table, so code that runs per rule, such as resolution, should keep idents
+ * rather than strings. Interned strings live for the rest of the process:
+ * the table grows with the number of distinct strings ever used as keys or
+ * symbols, not with the number of idents.
+ */
+class crt::ident
+{
+public:
+    ident()                      : ptr(empty_string()) {}
+    ident(const char* str)       : ptr(intern(str)) {}
+    ident(const std::string& str): ptr(intern(str)) {}
+
+    const std::string& str()  const { return *ptr; }
+    operator const std::string&() const { return *ptr; }
+    const char* data()        const { return ptr->data(); }
+    bool empty()              const { return ptr->empty(); }
+    std::uintptr_t id()       const { return reinterpret_cast<std::uintptr_t>(ptr); }
+
+    bool operator==(const ident& other)       const { return ptr == other.ptr; }
+    bool operator!=(const ident& other)       const { return ptr != other.ptr; }
+    bool operator==(const std::string& other) const { return *ptr == other; }
+    bool operator!=(const std::string& other) const { return *ptr != other; }
+    bool operator==(const char* other)        const { return *ptr == other; }
+    bool operator!=(const char* other)        const { return *ptr != other; }
+    bool operator<(const ident& other)        const { return *ptr < *other.ptr; }
+
+private:
+
+
+    /**
+     * Return the address of the table entry for the given string, adding it
+     * if necessary. The table is node-based, so entries never move, and it
+     * is split into shards by hash, so that threads interning different
+     * strings rarely contend.
+     */
+    static const std::string* intern(const std::string& str)
+    {
+        struct shard_t
+        {
+            std::mutex mutex;
+            std::unordered_set<std::string> table;
+        };
+        static std::array<shard_t, 32> shards;
+        auto& shard = shards[(std::hash<std::string>()(str) >> 7) % shards.size()];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return &*shard.table.insert(str).first;
+    }
+
+    static const std::string* empty_string()
+    {
+        static const std::string* e = intern(std::string());
+        return e;
+    }
+
+    const std::string* ptr;
+};
+
+
+
+
+//=============================================================================
+namespace std
+{
+    template<>
+    struct hash<crt::ident>
+    {
+        std::size_t operator()(const crt::ident& i) const
+        {
+            // Table entries are aligned, so the low bits are mixed in from above.
+            auto h = std::uint64_t(i.id());
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            return std::size_t(h);
+        }
+    };
+}
+
+
+
+
 //=============================================================================
 class crt::expression
 {
@@ -98,18 +248,7 @@ public:
      * Construct an expression from a pair of iterators.
      */
     template<typename IteratorType>
-    expression(IteratorType first, IteratorType second)
-    {
-        auto transient_parts = parts.transient();
-
-        while (first != second)
-        {
-            transient_parts.push_back(*first);
-            ++first;
-        }
-        parts = transient_parts.persistent();
-        type = parts.empty() ? data_type::none : data_type::table;
-    }
+    expression(IteratorType first, IteratorType second) : expression(collect(first, second)) {}
 
 
     /**
@@ -123,37 +262,120 @@ public:
      */
     expression()                          : type(data_type::none) {}
     expression(const none&)               : type(data_type::none) {}
-    expression(int vali32)                : type(data_type::i32), vali32(vali32) {}
-    expression(float valf64)              : type(data_type::f64), valf64(valf64) {}
-    expression(double valf64)             : type(data_type::f64), valf64(valf64) {}
-    expression(const char* valstr)        : type(data_type::str), valstr(valstr) {}
-    expression(const std::string& valstr) : type(data_type::str), valstr(valstr) {}
-    expression(data_t valdata)            : type(data_type::data), valdata(valdata) {}
-    expression(func_t valfunc)            : type(data_type::function), valfunc(valfunc) {}
-    expression(cont_t parts)              : parts(parts)
-    {
-        type = parts.empty() ? data_type::none : data_type::table;
-    }
-
-
-    const auto& get_i32()      const { return vali32; }
-    const auto& get_f64()      const { return valf64; }
-    const auto& get_str()      const { return valstr.get(); }
-    const auto& get_sym()      const { return valsym.get(); }
-    const auto& get_func()     const { return valfunc; }
-    const auto& get_data()     const { return valdata; }
-    const auto& key()          const { return keyword.get(); }
+    expression(int vali32)                : type(data_type::i32), vali32(vali32) { rehash(); }
+    expression(float valf64)              : type(data_type::f64), valf64(valf64) { rehash(); }
+    expression(double valf64)             : type(data_type::f64), valf64(valf64) { rehash(); }
+    expression(const char* valstr)        : type(data_type::str), valstr(valstr) { rehash(); }
+    expression(const std::string& valstr) : type(data_type::str), valstr(valstr) { rehash(); }
+    expression(data_t valdata)            : type(data_type::data), valdata(std::move(valdata)) { rehash(); }
+    expression(func_t valfunc)            : type(data_type::function), valfunc(std::move(valfunc)) { rehash(); }
+    expression(cont_t parts)
+    {
+        if (! parts.empty())
+        {
+            auto syms = symbols_of(parts);
+            new (&valtable) table_t{std::move(parts), std::move(syms)};
+            type = data_type::table;
+            rehash();
+        }
+    }
+
+
+    /**
+     * Copy, move, and destroy the active member of the payload union.
+     */
+    expression(const expression& other)
+    : type(other.type)
+    , opaque(other.opaque)
+    , keyword(other.keyword)
+    , valhash(other.valhash)
+    {
+        switch (type)
+        {
+            case data_type::none     : break;
+            case data_type::i32      : vali32 = other.vali32; break;
+            case data_type::f64      : valf64 = other.valf64; break;
+            case data_type::str      : new (&valstr)   str_t   (other.valstr);   break;
+            case data_type::symbol   : new (&valsym)   symbol_t(other.valsym);   break;
+            case data_type::data     : new (&valdata)  data_t  (other.valdata);  break;
+            case data_type::function : new (&valfunc)  boxed_func_t(other.valfunc); break;
+            case data_type::table    : new (&valtable) table_t (other.valtable); break;
+        }
+    }
+
+    expression(expression&& other)
+    : type(other.type)
+    , opaque(other.opaque)
+    , keyword(std::move(other.keyword))
+    , valhash(other.valhash)
+    {
+        switch (type)
+        {
+            case data_type::none     : break;
+            case data_type::i32      : vali32 = other.vali32; break;
+            case data_type::f64      : valf64 = other.valf64; break;
+            case data_type::str      : new (&valstr)   str_t   (std::move(other.valstr));   break;
+            case data_type::symbol   : new (&valsym)   symbol_t(std::move(other.valsym));   break;
+            case data_type::data     : new (&valdata)  data_t  (std::move(other.valdata));  break;
+            case data_type::function : new (&valfunc)  boxed_func_t(std::move(other.valfunc)); break;
+            case data_type::table    : new (&valtable) table_t (std::move(other.valtable)); break;
+        }
+    }
+
+    expression& operator=(const expression& other)
+    {
+        if (this != &other)
+        {
+            *this = expression(other);
+        }
+        return *this;
+    }
+
+    expression& operator=(expression&& other)
+    {
+        if (this != &other)
+        {
+            // The other expression might be owned by this one (for example
+            // one of its parts), so it is moved out before this is destroyed.
+            auto moved = expression(std::move(other));
+            this->~expression();
+            new (this) expression(std::move(moved));
+        }
+        return *this;
+    }
+
+    ~expression()
+    {
+        switch (type)
+        {
+            case data_type::str      : valstr.~str_t(); break;
+            case data_type::symbol   : valsym.~symbol_t(); break;
+            case data_type::data     : valdata.~data_t(); break;
+            case data_type::function : valfunc.~boxed_func_t(); break;
+            case data_type::table    : valtable.~table_t(); break;
+            default: break;
+        }
+    }
+
+
+    int            get_i32()   const { return type == data_type::i32 ? vali32 : 0; }
+    double         get_f64()   const { return type == data_type::f64 ? valf64 : 0.0; }
+    const auto&    get_str()   const { return type == data_type::str ? valstr.get() : empty<std::string>(); }
+    const auto&    get_sym()   const { return type == data_type::symbol ? valsym.name.str() : empty<std::string>(); }
+    const auto&    get_func()  const { return type == data_type::function ? valfunc.get() : empty<func_t>(); }
+    const auto&    get_data()  const { return type == data_type::data ? valdata : empty<data_t>(); }
+    const auto& key()          const { return keyword; }
     auto dtype()               const { return type; }
     auto has_type(data_type t) const { return type == t; }
-    auto begin()               const { return parts.begin(); }
-    auto end()                 const { return parts.end(); }
-    auto rbegin()              const { return parts.rbegin(); }
-    auto rend()                const { return parts.rend(); }
-    expression first()         const { return parts.size() > 0 ? parts[0] : none(); }
-    expression second()        const { return parts.size() > 1 ? parts[1] : none(); }
-    expression third()         const { return parts.size() > 2 ? parts[2] : none(); }
-    expression rest()          const { return parts.size() > 1 ? expression(begin() + 1, end()) : none(); }
-    expression last()          const { return parts.size() > 0 ? parts.back() : none(); }
+    auto begin()               const { return parts().begin(); }
+    auto end()                 const { return parts().end(); }
+    auto rbegin()              const { return parts().rbegin(); }
+    auto rend()                const { return parts().rend(); }
+    expression first()         const { return parts().size() > 0 ? parts()[0] : none(); }
+    expression second()        const { return parts().size() > 1 ? parts()[1] : none(); }
+    expression third()         const { return parts().size() > 2 ? parts()[2] : none(); }
+    expression rest()          const { return parts().size() > 1 ? expression(begin() + 1, end()) : none(); }
+    expression last()          const { return parts().size() > 0 ? parts().back() : none(); }
     operator bool()            const { return as_boolean(); }
     operator int()             const { return as_i32(); }
     operator float()           const { return as_f64(); }
@@ -163,15 +385,22 @@ public:
 
 
     /**
-     * Return a copy of this expression with a different key.
+     * Return a copy of this expression with a different key. Called on an
+     * rvalue, the expression is moved rather than copied.
      */
-    expression keyed(immer::box<std::string> kw) const
+    expression keyed(ident kw) const &
     {
         auto e = *this;
         e.keyword = kw;
         return e;
     }
 
+    expression keyed(ident kw) &&
+    {
+        keyword = kw;
+        return std::move(*this);
+    }
+
 
     /**
      * Convenience method to return a default value for this expression, if it
@@ -189,7 +418,7 @@ public:
      */
     const expression& at(std::size_t index) const
     {
-        return parts.at(index);
+        return parts().at(index);
     }
 
 
@@ -198,7 +427,7 @@ public:
      */
     std::size_t size() const
     {
-        return parts.size();
+        return parts().size();
     }
 
 
@@ -210,7 +439,7 @@ public:
     {
         return
         (type == data_type::none) ||
-        (type == data_type::table && parts.empty());
+        (type == data_type::table && parts().empty());
     }
 
 
@@ -222,10 +451,10 @@ public:
            case data_type::i32      : return vali32;
            case data_type::f64      : return valf64;
            case data_type::str      : return ! valstr->empty();
-           case data_type::symbol   : return ! valsym->empty();
+           case data_type::symbol   : return ! valsym.name.empty();
            case data_type::data     : return valdata != nullptr;
-           case data_type::function : return valfunc != nullptr;
-           case data_type::table    : return ! parts.empty();
+           case data_type::function : return *valfunc != nullptr;
+           case data_type::table    : return ! parts().empty();
        }
        return false;
     }
@@ -276,7 +505,7 @@ public:
             case data_type::i32      : return std::to_string(vali32);
             case data_type::f64      : return std::to_string(valf64);
             case data_type::str      : return valstr;
-            case data_type::symbol   : return valsym;
+            case data_type::symbol   : return valsym.name.str();
             case data_type::data     : return valdata ? "()" : valdata->type_name();
             case data_type::function : return "<func>";
             case data_type::table    : return unparse();
@@ -293,29 +522,47 @@ public:
      */
     std::string unparse() const
     {
-        auto pre = keyword->empty() ? "" : *keyword + "=";
+        auto out = std::string();
+        unparse(out);
+        return out;
+    }
 
-        switch (type)
-        {
-            case data_type::none     : return pre + "()";
-            case data_type::i32      : return pre + std::to_string(vali32);
-            case data_type::f64      : return pre + std::to_string(valf64);
-            case data_type::str      : return pre + "'" + *valstr + "'";
-            case data_type::symbol   : return pre + *valsym;
-            case data_type::data     : return pre + valdata->to_table().unparse();
-            case data_type::function : return pre + "<func>";
-            case data_type::table:
-            {
-                std::string res;
 
-                for (const auto& part : parts)
-                {
-                    res += " " + part->unparse();
-                }
-                return pre + "(" + res.substr(1) + ")";
-            }
+    /**
+     * Append the unparsed expression to the given buffer, which can be
+     * reused between calls to avoid allocations. For previews, at most
+     * max_length characters are written before the output is cut short with
+     * "...", and tables nested max_depth or more levels deep are written as
+     * "(...)". Returns false if the output was cut short.
+     */
+    bool unparse(std::string& out,
+        std::size_t max_length=std::string::npos,
+        std::size_t max_depth=std::string::npos) const
+    {
+        auto start = out.size();
+
+        if (! unparse_to(out, start, max_length, max_depth))
+        {
+            out.resize(start + max_length);
+            out += "...";
+            return false;
         }
-        return std::string();
+        return true;
+    }
+
+
+    /**
+     * Write the unparsed expression to the given stream, with the same
+     * limits as above.
+     */
+    bool unparse(std::ostream& os,
+        std::size_t max_length=std::string::npos,
+        std::size_t max_depth=std::string::npos) const
+    {
+        auto out = std::string();
+        auto result = unparse(out, max_length, max_depth);
+        os.write(out.data(), out.size());
+        return result;
     }
 
 
@@ -372,29 +619,16 @@ public:
 
     /**
      * Return a set of all symbols referenced at any level in this expression.
+     * The set is computed once when the expression is built, and is shared
+     * by its copies.
      */
-    immer::set<std::string> symbols() const
+    const symbols_t& symbols() const
     {
         switch (type)
         {
-            case data_type::symbol:
-            {
-                return immer::set<std::string>().insert(valsym);
-            }
-            case data_type::table:
-            {
-                auto result = immer::set<std::string>();
-
-                for (const auto& part : parts)
-                {
-                    for (const auto& s : part->symbols())
-                    {
-                        result = std::move(result).insert(s);
-                    }
-                }
-                return result;
-            }
-            default: return {};
+            case data_type::symbol : return valsym.syms;
+            case data_type::table  : return valtable.syms;
+            default: return empty<symbols_t>();
         }
     }
 
@@ -413,9 +647,14 @@ public:
      * Return an expression built from the parts of this, appending the additional
      * part provided.
      */
-    expression append(const expression& e) const
+    expression append(const expression& e) const &
+    {
+        return parts().push_back(e);
+    }
+
+    expression append(const expression& e) &&
     {
-        return parts.push_back(e);
+        return take_parts().push_back(e);
     }
 
 
@@ -425,7 +664,7 @@ public:
      */
     expression concat(const expression& more) const
     {
-        return parts + more.parts;
+        return parts() + more.parts();
     }
 
 
@@ -434,25 +673,35 @@ public:
      */
     expression splice(std::size_t index, const expression& e) const
     {
-        return parts.insert(index, e.parts);
+        return parts().insert(index, e.parts());
     }
 
 
     /**
      * Insert another expression at the front.
      */
-    expression prepend(const expression& e) const
+    expression prepend(const expression& e) const &
+    {
+        return parts().push_front(e);
+    }
+
+    expression prepend(const expression& e) &&
     {
-        return parts.push_front(e);
+        return take_parts().push_front(e);
     }
 
 
     /**
      * Insert another expression at the given index.
      */
-    expression insert(std::size_t index, const expression& e) const
+    expression insert(std::size_t index, const expression& e) const &
     {
-        return parts.insert(index, e);
+        return parts().insert(index, e);
+    }
+
+    expression insert(std::size_t index, const expression& e) &&
+    {
+        return take_parts().insert(index, e);
     }
 
 
@@ -461,7 +710,7 @@ public:
      */
     expression pop_back(std::size_t num=1) const
     {
-        return parts.take(parts.size() - num);
+        return parts().take(parts().size() - num);
     }
 
 
@@ -470,7 +719,7 @@ public:
      */
     expression pop_front(std::size_t num=1) const
     {
-        return parts.drop(num);
+        return parts().drop(num);
     }
 
 
@@ -479,7 +728,7 @@ public:
      */
     expression take(std::size_t num) const
     {
-        return parts.take(num);
+        return parts().take(num);
     }
 
 
@@ -488,7 +737,7 @@ public:
      */
     expression erase(std::size_t index) const
     {
-        return parts.erase(index);
+        return parts().erase(index);
     }
 
 
@@ -497,7 +746,7 @@ public:
      */
     expression erase(std::size_t first_index, std::size_t final_index) const
     {
-        return parts.erase(first_index, final_index);
+        return parts().erase(first_index, final_index);
     }
 
 
@@ -529,9 +778,9 @@ public:
         }
         std::size_t n = 0;
 
-        for (const auto& part : parts)
+        for (const auto& part : parts())
         {
-            if (part->keyword->empty())
+            if (part->keyword.empty())
             {
                 if (n == index)
                 {
@@ -551,13 +800,13 @@ public:
      */
     expression attr(const std::string& key) const
     {
-        auto part = parts.rbegin();
+        auto part = parts().rbegin();
 
-        while (part != parts.rend())
+        while (part != parts().rend())
         {
-            if (*(*part)->keyword == key)
+            if ((*part)->keyword == key)
             {
-                return (*part)->keyed(std::string());
+                return (*part)->keyed(ident());
             }
             ++part;
         }
@@ -571,9 +820,9 @@ public:
      */
     expression part(std::size_t index) const
     {
-        if (index < parts.size())
+        if (index < parts().size())
         {
-            return parts.at(index);
+            return parts().at(index);
         }
         return {};
     }
@@ -599,7 +848,7 @@ public:
             case data_type::symbol:
             {
                 try {
-                    return scope.at(valsym).keyed(keyword);
+                    return scope.at(valsym.name).keyed(keyword);
                 }
                 catch (const std::out_of_range& e)
                 {
@@ -621,14 +870,14 @@ public:
         {
             case data_type::symbol:
             {
-                return symbol(*valsym == from ? to : *valsym).keyed(keyword);
+                return valsym.name == from ? symbol(to).keyed(keyword) : *this;
             }
             case data_type::table:
             {
-                auto result = parts.transient();
+                auto result = parts().transient();
                 std::size_t n = 0;
 
-                for (const auto& part : parts)
+                for (const auto& part : parts())
                 {
                     if (part->has_type(data_type::symbol) ||
                         part->has_type(data_type::table))
@@ -654,14 +903,14 @@ public:
         {
             case data_type::symbol:
             {
-                return *valsym == symbol ? e.keyed(keyword) : *this;
+                return valsym.name == symbol ? e.keyed(keyword) : *this;
             }
             case data_type::table:
             {
-                auto result = parts.transient();
+                auto result = parts().transient();
                 std::size_t n = 0;
 
-                for (const auto& part : parts)
+                for (const auto& part : parts())
                 {
                     if (part->has_type(data_type::symbol) ||
                         part->has_type(data_type::table))
@@ -692,10 +941,10 @@ public:
         {
             case data_type::table:
             {
-                auto result = parts.transient();
+                auto result = parts().transient();
                 std::size_t n = 0;
 
-                for (const auto& part : parts)
+                for (const auto& part : parts())
                 {
                     if (part->has_type(data_type::table))
                     {
@@ -720,7 +969,7 @@ public:
 
         for (const auto& part : lookup)
         {
-            result = result.substitute(*part->keyword, part);
+            result = result.substitute(part->keyword.str(), part);
         }
         return result;
     }
@@ -732,12 +981,12 @@ public:
      */
     expression with_attr(const std::string& key, const crt::expression& e) const
     {
-        auto result = parts.transient();
+        auto result = parts().transient();
         std::size_t n = 0;
 
-        for (const auto& part : parts)
+        for (const auto& part : parts())
         {
-            if (*part->keyword == key)
+            if (part->keyword == key)
             {
                 result.set(n, e.keyed(part->keyword));
             }
@@ -756,7 +1005,7 @@ public:
     {
         if (index < size())
         {
-            return expression(parts.set(index, e)).keyed(keyword);
+            return expression(parts().set(index, e)).keyed(keyword);
         }
         return *this;
     }
@@ -768,12 +1017,12 @@ public:
      */
     expression without_attr(const std::string& key) const
     {
-        auto result = parts;
+        auto result = parts();
         std::size_t n = 0;
 
-        for (const auto& part : parts)
+        for (const auto& part : parts())
         {
-            if (*part->keyword == key)
+            if (part->keyword == key)
             {
                 result = std::move(result).erase(n);
             }
@@ -795,7 +1044,7 @@ public:
     {
         if (index < size())
         {
-            return expression(parts.erase(index)).keyed(keyword);
+            return expression(parts().erase(index)).keyed(keyword);
         }
         return *this;
     }
@@ -846,10 +1095,10 @@ public:
             }            
         }
 
-        auto result = parts.transient();
+        auto result = parts().transient();
         std::size_t n = 0;
 
-        for (const auto& part : parts)
+        for (const auto& part : parts())
         {
             result.set(n, part->without(address.rest()));
             ++n;
@@ -884,11 +1133,11 @@ public:
      */
     expression call(const expression& args) const
     {
-        if (! has_type(crt::data_type::function) || ! valfunc)
+        if (! has_type(crt::data_type::function) || ! *valfunc)
         {
             throw std::runtime_error("expression is not a function");
         }
-        return valfunc(args).keyed(keyword);
+        return valfunc.get()(args).keyed(keyword);
     }
 
 
@@ -897,16 +1146,22 @@ public:
      */
     bool has_same_value(const crt::expression& other) const
     {
-        return
-        type       != data_type::function && // no equality testing for function types
-        other.type != data_type::function &&
-        type    == other.type    &&
-        vali32  == other.vali32  &&
-        valf64  == other.valf64  &&
-        valstr  == other.valstr  &&
-        valsym  == other.valsym  &&
-        valdata == other.valdata &&
-        parts   == other.parts;
+        if (type != other.type || valhash != other.valhash)
+        {
+            return false;
+        }
+        switch (type)
+        {
+            case data_type::none     : return true;
+            case data_type::i32      : return vali32 == other.vali32;
+            case data_type::f64      : return valf64 == other.valf64;
+            case data_type::str      : return valstr == other.valstr;
+            case data_type::symbol   : return valsym.name == other.valsym.name;
+            case data_type::data     : return valdata == other.valdata;
+            case data_type::function : return false; // no equality testing for function types
+            case data_type::table    : return same_parts(valtable.parts, other.valtable.parts);
+        }
+        return false;
     }
 
 
@@ -930,128 +1185,1076 @@ public:
     }
 
 
-private:
-    data_type               type = data_type::none;
-    immer::box<std::string> keyword;
-    int                     vali32 = 0;
-    double                  valf64 = 0.0;
-    immer::box<std::string> valstr;
-    immer::box<std::string> valsym;
-    crt::data_t             valdata;
-    crt::func_t             valfunc;
-    cont_t                  parts;
-    friend expression symbol(const std::string&);
-    friend class parser;
-};
-
+    /**
+     * Return a hash of the key, type, and value of this expression.
+     * Expressions that compare equal have the same hash. The hash of the
+     * type and value is computed once, when the expression is built (for
+     * tables, from the cached hashes of the parts), so this is O(1).
+     * Functions and user data are hashed by identity: copies of an
+     * expression share the same function or data instance.
+     */
+    std::size_t hash() const
+    {
+        return combine_hash(valhash, std::hash<ident>()(keyword));
+    }
 
 
+    /**
+     * Mix the hash value b into a.
+     */
+    static std::size_t combine_hash(std::size_t a, std::size_t b)
+    {
+        return a ^ (b + 0x9e3779b97f4a7c15ull + (a << 6) + (a >> 2));
+    }
 
-//=========================================================================
-/**
- * Return a symbol expression.
- */
-crt::expression crt::symbol(const std::string& v)
-{
-    auto e = expression();
-    e.type = data_type::symbol;
-    e.valsym = v;
-    return e;
-}
 
+private:
 
-/**
- * Create a user_data from the given value. You'll get a compile error if
- * there is no class definition for crt::type_info<T>.
- */
-template<typename T>
-crt::data_t crt::make_data(const T& v)
-{
-    return std::dynamic_pointer_cast<user_data>(std::make_shared<capsule<T>>(v));
-}
 
+    //=========================================================================
+    using str_t = box_t<std::string>;
+    using boxed_func_t = box_t<func_t>;
 
-/**
- * Return a function expression that constructs a user_data of the given type.
- * This is useful in concisely defining API's.
- */
-template<typename T>
-crt::func_t crt::init()
-{
-    return [] (const crt::expression& e) -> crt::expression
+    struct symbol_t
     {
-        return crt::make_data(e.to<T>());
+        ident name;
+        symbols_t syms;
     };
-}
-
 
-/**
- * Holder for user_data values. Client code probably does not need to use
- * this.
- */
-template<typename T>
-struct crt::capsule : public crt::user_data
-{
-    capsule() {}
-    capsule(const T& value) : value(value) {}
-    const char* type_name() const override { return type_info<T>::name(); }
-    expression to_table() const override { return type_info<T>::to_table(value); }
-    T value;
-};
-
-
-/**
- * This is a good general purpose call_adapter to be used with
- * expression::resolve. You can write your own, of course!
- */
-class crt::call_adapter
-{
-public:
-    template<typename Mapping>
-    crt::expression call(const Mapping& scope, const crt::expression& expr) const
+    struct table_t
     {
-        auto head = expr.first().resolve(scope, *this);
-        auto args = cont_t().transient();
+        cont_t parts;
+        symbols_t syms;
+    };
 
-        for (const auto& part : expr.rest())
-        {
-            args.push_back(part->resolve(scope, *this));
-        }
 
-        if (head.has_type(crt::data_type::function))
-        {
-            return head.call(args.persistent());
-        }
-        return head.nest().concat(args.persistent());
+    /**
+     * Return a reference to a default-constructed value of the given type.
+     * The accessors use this to return a reference when this expression
+     * holds a different data type.
+     */
+    template<typename T>
+    static const T& empty()
+    {
+        static const T value;
+        return value;
     }
-};
-
 
 
+    /**
+     * Return the parts of this expression, or an empty container if it is
+     * not a table.
+     */
+    const cont_t& parts() const
+    {
+        return type == data_type::table ? valtable.parts : empty<cont_t>();
+    }
 
-//=============================================================================
-class crt::parser
-{
 
-public:
+    /**
+     * Move the parts out of this expression, if it is a table, so that an
+     * rvalue-qualified method can update them without copying. This
+     * expression must not be used afterwards, other than to destroy it.
+     */
+    cont_t take_parts()
+    {
+        return type == data_type::table ? std::move(valtable.parts) : cont_t();
+    }
 
 
-    //=========================================================================
-    static expression parse(const char* source)
+    /**
+     * Return a container built from a pair of iterators.
+     */
+    template<typename IteratorType>
+    static cont_t collect(IteratorType first, IteratorType second)
     {
-        if (std::strlen(source) > 0 && source[0] == '(')
-        {
-            return parse_part(source);
-        }
-
-        auto parts = cont_t().transient();
-        auto c = source;
+        auto transient_parts = cont_t().transient();
 
-        while (*c != '\0')
+        while (first != second)
         {
-            parts.push_back(parse_part(c));
+            transient_parts.push_back(*first);
+            ++first;
         }
-        return parts.size() == 1 ? parts[0] : parts.persistent();
+        return transient_parts.persistent();
+    }
+
+
+    /**
+     * Compute the hash of the type and value of this expression, and whether
+     * it contains a function.
+     */
+    void rehash()
+    {
+        auto h = std::size_t(type);
+        opaque = type == data_type::function;
+
+        switch (type)
+        {
+            case data_type::none     : h = 0; break;
+            case data_type::i32      : h = combine_hash(h, std::hash<int>()(vali32)); break;
+            case data_type::f64      : h = combine_hash(h, std::hash<double>()(valf64)); break;
+            case data_type::str      : h = combine_hash(h, std::hash<std::string>()(valstr)); break;
+            case data_type::symbol   : h = combine_hash(h, std::hash<ident>()(valsym.name)); break;
+            case data_type::data     : h = combine_hash(h, std::hash<const void*>()(valdata.get())); break;
+            case data_type::function : h = combine_hash(h, std::hash<const void*>()(&valfunc.get())); break;
+            case data_type::table:
+            {
+                for (const auto& part : valtable.parts)
+                {
+                    h = combine_hash(h, part->hash());
+                    opaque |= part->opaque;
+                }
+                break;
+            }
+        }
+        valhash = h;
+    }
+
+
+    /**
+     * Compare two containers of parts. Parts that are the same node (as when
+     * they were built by a hash_cons) are equal without being compared,
+     * unless they contain a function, since functions never compare equal.
+     */
+    static bool same_parts(const cont_t& a, const cont_t& b)
+    {
+        if (a.size() != b.size())
+        {
+            return false;
+        }
+
+        auto i = a.begin();
+        auto j = b.begin();
+
+        for (; i != a.end(); ++i, ++j)
+        {
+            if ((&i->get() != &j->get() || i->get().opaque) && i->get() != j->get())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+
+    /**
+     * Return the union of the symbol sets of the given parts. Sets are
+     * merged smaller-into-larger, and a single non-empty set is shared
+     * rather than copied.
+     */
+    static symbols_t symbols_of(const cont_t& parts)
+    {
+        auto result = symbols_t();
+
+        for (const auto& part : parts)
+        {
+            auto more = part->symbols();
+
+            if (more.size() > result.size())
+            {
+                std::swap(result, more);
+            }
+            for (const auto& s : more)
+            {
+                result = std::move(result).insert(s);
+            }
+        }
+        return result;
+    }
+
+
+    /**
+     * The payload is a union sized to its largest member; the type field
+     * says which member is active. Functions are boxed so that they cost
+     * one reference count to copy, rather than a std::function copy.
+     */
+    data_type               type = data_type::none;
+    bool                    opaque = false;
+    ident                   keyword;
+    std::size_t             valhash = 0;
+
+    union
+    {
+        int                 vali32;
+        double              valf64;
+        str_t               valstr;
+        symbol_t            valsym;
+        data_t              valdata;
+        boxed_func_t        valfunc;
+        table_t             valtable;
+    };
+
+
+    /**
+     * Formatting helpers used by unparse. Integers are formatted by hand, and
+     * doubles with snprintf("%f"), matching std::to_string.
+     */
+    static void append_i32(std::string& out, int v)
+    {
+        char buffer[12];
+        char* c = buffer + sizeof(buffer);
+        auto u = v < 0 ? 0u - unsigned(v) : unsigned(v);
+
+        do
+        {
+            *--c = char('0' + u % 10);
+            u /= 10;
+        } while (u);
+
+        if (v < 0)
+        {
+            *--c = '-';
+        }
+        out.append(c, buffer + sizeof(buffer));
+    }
+
+    static void append_f64(std::string& out, double v)
+    {
+        char buffer[64];
+        int n = std::snprintf(buffer, sizeof(buffer), "%f", v);
+
+        if (n < 0 || std::size_t(n) >= sizeof(buffer))
+        {
+            out += std::to_string(v);
+            return;
+        }
+        out.append(buffer, n);
+    }
+
+    bool unparse_to(std::string& out, std::size_t start, std::size_t max_length, std::size_t depth) const
+    {
+        if (! keyword.empty())
+        {
+            out += keyword.str();
+            out += '=';
+        }
+
+        switch (type)
+        {
+            case data_type::none     : out += "()"; break;
+            case data_type::i32      : append_i32(out, vali32); break;
+            case data_type::f64      : append_f64(out, valf64); break;
+            case data_type::str      : out += '\''; out += *valstr; out += '\''; break;
+            case data_type::symbol   : out += valsym.name.str(); break;
+            case data_type::data     : return valdata->to_table().unparse_to(out, start, max_length, depth);
+            case data_type::function : out += "<func>"; break;
+            case data_type::table:
+            {
+                if (depth == 0)
+                {
+                    out += "(...)";
+                    break;
+                }
+
+                auto separator = '(';
+
+                for (const auto& part : parts())
+                {
+                    out += separator;
+                    separator = ' ';
+
+                    if (! part->unparse_to(out, start, max_length, depth - 1))
+                    {
+                        return false;
+                    }
+                }
+                out += separator == '(' ? "()" : ")";
+                break;
+            }
+        }
+        return out.size() - start <= max_length;
+    }
+
+
+    friend expression symbol(ident);
+    friend class hash_cons;
+    friend class parser;
+    friend class snapshot_writer;
+};
+
+
+
+
+//=========================================================================
+namespace std
+{
+    template<>
+    struct hash<crt::expression>
+    {
+        std::size_t operator()(const crt::expression& e) const
+        {
+            return e.hash();
+        }
+    };
+}
+
+
+
+
+//=========================================================================
+/**
+ * Return a symbol expression.
+ */
+crt::expression crt::symbol(ident v)
+{
+    auto e = expression();
+    new (&e.valsym) expression::symbol_t{v, symbols_t().insert(v)};
+    e.type = data_type::symbol;
+    e.rehash();
+    return e;
+}
+
+
+/**
+ * An allocator that keeps freed single objects on a per-thread free list for
+ * each object size, bounded in length, so that repeatedly making and
+ * dropping small objects (such as user_data capsules during resolution)
+ * mostly avoids the global allocator and its lock. A block freed on another
+ * thread joins that thread's list. Arrays go straight to operator new.
+ */
+template<typename T>
+class crt::pool_allocator
+{
+public:
+    using value_type = T;
+
+    pool_allocator() {}
+    template<typename U> pool_allocator(const pool_allocator<U>&) {}
+
+    T* allocate(std::size_t n)
+    {
+        if (n == 1)
+        {
+            return static_cast<T*>(free_list<sizeof(T)>::pop());
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (n == 1)
+        {
+            free_list<sizeof(T)>::push(p);
+            return;
+        }
+        ::operator delete(p);
+    }
+
+    template<typename U> bool operator==(const pool_allocator<U>&) const { return true; }
+    template<typename U> bool operator!=(const pool_allocator<U>&) const { return false; }
+
+private:
+    template<std::size_t Size>
+    struct free_list
+    {
+        union node_t
+        {
+            node_t* next;
+            alignas(alignof(std::max_align_t)) char data[Size];
+        };
+
+        struct list_t
+        {
+            ~list_t()
+            {
+                while (first)
+                {
+                    auto next = first->next;
+                    ::operator delete(first);
+                    first = next;
+                }
+                count = limit;
+            }
+            node_t* first = nullptr;
+            std::size_t count = 0;
+        };
+
+        static void* pop()
+        {
+            auto& list = local();
+
+            if (list.first)
+            {
+                auto node = list.first;
+                list.first = node->next;
+                --list.count;
+                return node;
+            }
+            return ::operator new(sizeof(node_t));
+        }
+
+        static void push(void* p)
+        {
+            auto& list = local();
+
+            if (list.count >= limit)
+            {
+                ::operator delete(p);
+                return;
+            }
+            auto node = static_cast<node_t*>(p);
+            node->next = list.first;
+            list.first = node;
+            ++list.count;
+        }
+
+        static list_t& local()
+        {
+            thread_local list_t list;
+            return list;
+        }
+
+        static const std::size_t limit = 1024;
+    };
+};
+
+
+/**
+ * Create a user_data from the given value. You'll get a compile error if
+ * there is no class definition for crt::type_info<T>. The capsule and its
+ * reference count share one block, taken from a pool_allocator.
+ */
+template<typename T>
+crt::data_t crt::make_data(const T& v)
+{
+    return std::allocate_shared<capsule<T>>(pool_allocator<capsule<T>>(), v);
+}
+
+
+/**
+ * Return a function expression that constructs a user_data of the given type.
+ * This is useful in concisely defining API's.
+ */
+template<typename T>
+crt::func_t crt::init()
+{
+    return [] (const crt::expression& e) -> crt::expression
+    {
+        return crt::make_data(e.to<T>());
+    };
+}
+
+
+/**
+ * Holder for user_data values. Client code probably does not need to use
+ * this.
+ */
+template<typename T>
+struct crt::capsule : public crt::user_data
+{
+    capsule() {}
+    capsule(const T& value) : value(value) {}
+    const char* type_name() const override { return type_info<T>::name(); }
+    expression to_table() const override { return type_info<T>::to_table(value); }
+    bool serialize(std::string& out) const override { return serialize_with(value, out, 0); }
+    std::size_t size_bytes() const override { return size_with(value, 0); }
+    T value;
+
+private:
+    template<typename U>
+    static auto serialize_with(const U& v, std::string& out, int) -> decltype(type_info<U>::serialize(v, out), bool())
+    {
+        type_info<U>::serialize(v, out);
+        return true;
+    }
+
+    template<typename U>
+    static bool serialize_with(const U&, std::string&, long)
+    {
+        return false;
+    }
+
+    template<typename U>
+    static auto size_with(const U& v, int) -> decltype(type_info<U>::size_bytes(v), std::size_t())
+    {
+        return type_info<U>::size_bytes(v);
+    }
+
+    template<typename U>
+    static std::size_t size_with(const U&, long)
+    {
+        return sizeof(U);
+    }
+};
+
+
+/**
+ * A function taking its resolved arguments as an array, rather than packed
+ * into a table. These are made by crt::native (see crt-native.hpp), which
+ * wraps one in a native_call so that it is an ordinary func_t; the call
+ * adapters recognize a native_call and pass it the resolved parts directly.
+ */
+class crt::native_function
+{
+public:
+    virtual ~native_function() {}
+
+    /** Return true if a call with n arguments is possible. */
+    virtual bool accepts(std::size_t n) const = 0;
+
+    /** Return true if the arguments match the parameter types without conversion. */
+    virtual bool exact(const expression* args, std::size_t n) const = 0;
+
+    virtual expression invoke(const expression* args, std::size_t n) const = 0;
+};
+
+
+/**
+ * The func_t target for a native_function. Called as a func_t, it unpacks
+ * the table of arguments; call adapters use try_call instead, which resolves
+ * up to max_args parts into an array on the stack.
+ */
+struct crt::native_call
+{
+    enum { max_args = 8 };
+
+    expression operator()(const expression& args) const
+    {
+        auto argv = std::vector<expression>();
+        argv.reserve(args.size());
+
+        for (const auto& part : args)
+        {
+            argv.push_back(*part);
+        }
+        return impl->invoke(argv.data(), argv.size());
+    }
+
+
+    /**
+     * If head is a native function, and expr has at most max_args arguments,
+     * resolve them and call it, placing the result in result and returning
+     * true. Otherwise return false without resolving anything.
+     */
+    template<typename Mapping, typename CallAdapter>
+    static bool try_call(
+        const expression& head,
+        const expression& expr,
+        const Mapping& scope,
+        const CallAdapter& adapter,
+        expression& result)
+    {
+        auto native = head.get_func().target<native_call>();
+
+        if (! native || expr.size() > max_args + 1)
+        {
+            return false;
+        }
+
+        expression argv[max_args];
+        std::size_t n = 0;
+
+        for (auto part = expr.begin() + 1; part != expr.end(); ++part)
+        {
+            argv[n++] = (*part)->resolve(scope, adapter);
+        }
+        result = native->impl->invoke(argv, n).keyed(head.key());
+        return true;
+    }
+
+    std::shared_ptr<const native_function> impl;
+};
+
+
+/**
+ * Hooks for observing the resolver. An instrument receives events once it is
+ * installed with instrument::install; while none is installed, each hook site
+ * costs one atomic load and a branch. The hooks may be called from several
+ * threads at once, and an installed instrument must outlive any resolution
+ * in progress.
+ */
+class crt::instrument
+{
+public:
+    virtual ~instrument() {}
+
+    /**
+     * A rule was submitted to a worker pool, by the resolve identified by
+     * run. Concurrent resolves have different run ids.
+     */
+    virtual void rule_queued(const ident&, std::uintptr_t /*run*/) {}
+
+    /**
+     * Evaluation of a rule began on the calling thread, for the resolve
+     * identified by run, or zero if the rule was not queued.
+     */
+    virtual void rule_started(const ident&, std::uintptr_t /*run*/) {}
+
+    /** Evaluation of a rule ended on the calling thread, possibly by throwing. */
+    virtual void rule_finished(const ident&) {}
+
+    /** A memoizing_call_adapter looked up a call on the calling thread: true on a hit. */
+    virtual void cache_lookup(bool) {}
+
+    static instrument* installed() { return slot().load(std::memory_order_acquire); }
+    static void install(instrument* i) { slot().store(i, std::memory_order_release); }
+
+
+    /**
+     * Reports rule_started on construction and rule_finished on destruction,
+     * to the instrument that was installed at construction.
+     */
+    class evaluation
+    {
+    public:
+        evaluation(ident key, std::uintptr_t run=0) : ins(installed()), key(key) { if (ins) ins->rule_started(key, run); }
+        ~evaluation() { if (ins) ins->rule_finished(key); }
+        evaluation(const evaluation&) = delete;
+        evaluation& operator=(const evaluation&) = delete;
+    private:
+        instrument* ins;
+        ident key;
+    };
+
+private:
+    static std::atomic<instrument*>& slot()
+    {
+        static std::atomic<instrument*> current(nullptr);
+        return current;
+    }
+};
+
+
+/**
+ * This is a good general purpose call_adapter to be used with
+ * expression::resolve. You can write your own, of course!
+ */
+class crt::call_adapter
+{
+public:
+    template<typename Mapping>
+    crt::expression call(const Mapping& scope, const crt::expression& expr) const
+    {
+        auto head = expr.first().resolve(scope, *this);
+        auto result = expression();
+
+        if (native_call::try_call(head, expr, scope, *this, result))
+        {
+            return result;
+        }
+
+        // The argument table is built fresh for each call, rather than in a
+        // reused buffer: it is handed to the function as a persistent table,
+        // which the function may keep (in its result, say), and calls nest
+        // as arguments are resolved, so a shared buffer would be clobbered.
+        // Native functions (see native_call) take their arguments without
+        // building a table at all.
+        auto args = cont_t().transient();
+
+        for (auto part = expr.begin() + (expr.size() > 0); part != expr.end(); ++part)
+        {
+            args.push_back((*part)->resolve(scope, *this));
+        }
+
+        if (head.has_type(crt::data_type::function))
+        {
+            return head.call(args.persistent());
+        }
+        return head.nest().concat(args.persistent());
+    }
+};
+
+
+
+
+/**
+ * A call adapter that caches the results of function calls, keyed by the
+ * function's identity and the resolved arguments. Only calls whose head is a
+ * symbol marked with mark_pure are cached, since caching a function with
+ * side effects would change its behavior. The cache holds at most the given
+ * number of results, evicting the least recently used. It is safe to share
+ * between threads; concurrent misses on the same call may compute it more
+ * than once.
+ */
+class crt::memoizing_call_adapter
+{
+public:
+
+
+    memoizing_call_adapter(std::size_t capacity=1024) : capacity(capacity) {}
+
+
+    /**
+     * Mark the function bound to the given symbol as pure, so that calls to
+     * it are cached.
+     */
+    memoizing_call_adapter& mark_pure(ident name)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pure.insert(name);
+        return *this;
+    }
+
+
+    std::size_t hits()   const { return num_hits; }
+    std::size_t misses() const { return num_misses; }
+
+
+    template<typename Mapping>
+    crt::expression call(const Mapping& scope, const crt::expression& expr) const
+    {
+        auto name = expr.first();
+        auto head = name.resolve(scope, *this);
+        auto result = expression();
+        auto memoize = head.has_type(crt::data_type::function)
+            && name.has_type(crt::data_type::symbol)
+            && is_pure(name.get_sym());
+
+        if (! memoize && native_call::try_call(head, expr, scope, *this, result))
+        {
+            return result;
+        }
+
+        // Built fresh for each call, as in call_adapter; here the table is
+        // also kept in the cache.
+        auto args = cont_t().transient();
+
+        for (auto part = expr.begin() + (expr.size() > 0); part != expr.end(); ++part)
+        {
+            args.push_back((*part)->resolve(scope, *this));
+        }
+
+        if (! head.has_type(crt::data_type::function))
+        {
+            return head.nest().concat(args.persistent());
+        }
+        if (! memoize)
+        {
+            return head.call(args.persistent());
+        }
+
+        auto a = expression(args.persistent());
+        auto h = expression::combine_hash(head.hash(), a.hash());
+
+        auto ins = instrument::installed();
+
+        if (find(h, head, a, result))
+        {
+            ++num_hits;
+            if (ins) ins->cache_lookup(true);
+            return result;
+        }
+
+        ++num_misses;
+        if (ins) ins->cache_lookup(false);
+        result = head.call(a);
+        remember(h, head, a, result);
+        return result;
+    }
+
+
+private:
+
+
+    //=========================================================================
+    struct entry_t
+    {
+        std::size_t hash;
+        expression head;
+        expression args;
+        expression result;
+    };
+
+    using lru_t = std::list<entry_t>;
+
+
+    bool is_pure(ident name) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pure.count(name) != 0;
+    }
+
+
+    /**
+     * Look up a cached call, and move it to the front of the LRU list if it
+     * is found. The head is matched by function identity (function
+     * expressions never compare equal), and the arguments by equality.
+     */
+    bool find(std::size_t h, const expression& head, const expression& args, expression& result) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto range = index.equal_range(h);
+
+        for (auto i = range.first; i != range.second; ++i)
+        {
+            auto entry = i->second;
+
+            if (&entry->head.get_func() == &head.get_func() &&
+                entry->head.key() == head.key() &&
+                entry->args == args)
+            {
+                lru.splice(lru.begin(), lru, entry);
+                result = entry->result;
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    void remember(std::size_t h, const expression& head, const expression& args, const expression& result) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        lru.push_front({h, head, args, result});
+        index.emplace(h, lru.begin());
+
+        while (lru.size() > capacity)
+        {
+            auto range = index.equal_range(lru.back().hash);
+
+            for (auto i = range.first; i != range.second; ++i)
+            {
+                if (i->second == std::prev(lru.end()))
+                {
+                    index.erase(i);
+                    break;
+                }
+            }
+            lru.pop_back();
+        }
+    }
+
+
+    std::size_t capacity;
+    std::unordered_set<ident> pure;
+    mutable lru_t lru;
+    mutable std::unordered_multimap<std::size_t, lru_t::iterator> index;
+    mutable std::atomic<std::size_t> num_hits = {0};
+    mutable std::atomic<std::size_t> num_misses = {0};
+    mutable std::mutex mutex;
+};
+
+
+
+
+/**
+ * A hash-consing factory: it returns expressions equal to the ones given, in
+ * which equal sub-tables (at any depth) are the same shared node. This saves
+ * memory for documents with many repeated sub-expressions, and makes
+ * comparing the canonical expressions nearly O(1), since shared parts are
+ * not compared. Nodes are held until the factory is destroyed. Nodes that
+ * hold a function (which is unequal to everything) are not shared or held,
+ * though the sub-tables inside them are. It is safe to share between
+ * threads.
+ */
+class crt::hash_cons
+{
+public:
+
+
+    /**
+     * Return the canonical version of the given expression.
+     */
+    expression operator()(const expression& e)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto shareable = true;
+        return canonical(e, shareable);
+    }
+
+
+    /**
+     * Return the number of distinct nodes held.
+     */
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return nodes.size();
+    }
+
+
+private:
+
+
+    /**
+     * Return the canonical version of e, setting shareable to false if it
+     * holds a function. Functions are unequal even to themselves, so such
+     * nodes could never be found again, and are not added to the table.
+     */
+    expression canonical(const expression& e, bool& shareable)
+    {
+        if (! e.has_type(data_type::table))
+        {
+            shareable = ! e.has_type(data_type::function);
+            return e;
+        }
+
+        auto parts = e.valtable.parts;
+        auto n = std::size_t(0);
+        shareable = true;
+
+        for (const auto& part : e.valtable.parts)
+        {
+            auto part_shareable = true;
+            auto node = canonical_node(part, part_shareable);
+            shareable = shareable && part_shareable;
+
+            if (&node.get() != &part.get())
+            {
+                parts = std::move(parts).set(n, node);
+            }
+            ++n;
+        }
+        return expression(parts).keyed(e.keyword);
+    }
+
+
+    box_t<expression> canonical_node(const box_t<expression>& node, bool& shareable)
+    {
+        auto range = nodes.equal_range(node->hash());
+
+        for (auto i = range.first; i != range.second; ++i)
+        {
+            if (i->second.get() == node.get())
+            {
+                return i->second;
+            }
+        }
+
+        auto result = box_t<expression>(canonical(node, shareable));
+
+        if (shareable)
+        {
+            nodes.emplace(node->hash(), result);
+        }
+        return result;
+    }
+
+
+    std::unordered_multimap<std::size_t, box_t<expression>> nodes;
+    mutable std::mutex mutex;
+};
+
+
+
+
+//=============================================================================
+/**
+ * A single-pass parser. It reads a range of characters [first, last), which
+ * need not be null-terminated, so it can work directly on a memory-mapped
+ * file. Nested tables are handled with an explicit stack rather than by
+ * recursion, so the running time is linear in the source length and deep
+ * nesting does not overflow the call stack.
+ */
+class crt::parser
+{
+
+public:
+
+
+    //=========================================================================
+    /**
+     * Parse a null-terminated source string. The source is a sequence of
+     * parts: if there is exactly one then it is returned, and otherwise a
+     * table of the parts is returned.
+     */
+    static expression parse(const char* source)
+    {
+        return parse(source, source + std::strlen(source));
+    }
+
+
+    /**
+     * Parse the characters in the range [first, last).
+     */
+    static expression parse(const char* first, const char* last)
+    {
+        auto parts = cont_t().transient();
+        auto emit = [&parts] (expression e) { parts.push_back(std::move(e)); };
+
+        parse_sequence(first, last, emit);
+
+        if (parts.size() == 1)
+        {
+            return parts[0];
+        }
+        return parts.persistent();
+    }
+
+
+    /**
+     * Call fn with each item of the document in [first, last), as soon as
+     * that item is parsed. If the document consists of a single table, then
+     * the items are its parts, and otherwise they are the top-level parts.
+     * Only one item at a time is held in memory.
+     */
+    template<typename Fn>
+    static void parse_items(const char* first, const char* last, Fn fn)
+    {
+        auto items = item_range(first, last);
+        parse_sequence(items.first, items.second, fn);
+    }
+
+
+    /**
+     * Return the range holding the items of the document in [first, last),
+     * as parse_items sees them: the inside of a single enclosing table, or
+     * otherwise the whole range.
+     */
+    static std::pair<const char*, const char*> item_range(const char* first, const char* last)
+    {
+        auto c = skip_space(first, last);
+
+        if (c != last && *c == '(')
+        {
+            auto close = find_closing_parentheses(c, last);
+
+            if (skip_space(close, last) == last)
+            {
+                return {c + 1, close - 1};
+            }
+        }
+        return {first, last};
+    }
+
+
+    /**
+     * Return positions dividing [first, last) into at most n ranges of about
+     * equal length, each holding whole top-level parts, starting with first
+     * and ending with last. The ranges can be parsed independently. This is
+     * a single scan that only tracks parentheses and quotes; syntax errors
+     * are left for the parse.
+     */
+    static std::vector<const char*> split_parts(const char* first, const char* last, std::size_t n)
+    {
+        auto cuts = std::vector<const char*>{first};
+        auto length = std::size_t(last - first);
+        std::size_t next = 1;
+        int level = 0;
+        bool in_str = false;
+        char previous = '\0';
+
+        for (auto c = first; c != last && next < n; ++c)
+        {
+            if (in_str)
+            {
+                in_str = *c != '\'';
+            }
+            else if (*c == '\'')
+            {
+                in_str = true;
+            }
+            else if (*c == '(')
+            {
+                ++level;
+            }
+            else if (*c == ')')
+            {
+                --level;
+            }
+            else if (std::isspace(*c))
+            {
+                if (level == 0 && previous != '=' && std::size_t(c - first) >= next * length / n)
+                {
+                    cuts.push_back(c);
+                    ++next;
+                }
+                continue;
+            }
+            previous = *c;
+        }
+        cuts.push_back(last);
+        return cuts;
     }
 
 
@@ -1069,7 +2272,12 @@ private:
         return std::isalpha(e) || e == '_' || e == '-' || e == '+' || e == ':' || e == '@';
     }
 
-    static bool is_number(const char* d)
+    static char peek(const char* c, const char* last, std::size_t n)
+    {
+        return c + n < last ? c[n] : '\0';
+    }
+
+    static bool is_number(const char* d, const char* last)
     {
         if (std::isdigit(*d))
         {
@@ -1077,39 +2285,58 @@ private:
         }
         else if (*d == '.')
         {
-            return std::isdigit(d[1]);
+            return std::isdigit(peek(d, last, 1));
         }
         else if (*d == '+' || *d == '-')
         {
-            return std::isdigit(d[1]) || (d[1] == '.' && std::isdigit(d[2]));
+            return std::isdigit(peek(d, last, 1)) || (peek(d, last, 1) == '.' && std::isdigit(peek(d, last, 2)));
         }
         return false;
     }
 
-    static const char* get_named_part(const char*& c)
+    static bool is_terminator(const char* c, const char* last)
+    {
+        return c == last || std::isspace(*c) || *c == ')';
+    }
+
+    static const char* skip_space(const char* c, const char* last)
+    {
+        while (c != last && std::isspace(*c))
+        {
+            ++c;
+        }
+        return c;
+    }
+
+    static const char* get_named_part(const char*& c, const char* last)
     {
         const char* cc = c;
-        const char* start = c;
 
-        while (is_symbol_character(*cc++))
+        while (cc != last && is_symbol_character(*cc))
         {
-            if (*cc == '=')
-            {
-                c = cc + 1;
-                return start;
-            }
+            ++cc;
+        }
+        if (cc != c && cc != last && *cc == '=')
+        {
+            const char* start = c;
+            c = cc + 1;
+            return start;
         }
         return nullptr;
     }
 
-    static const char* find_closing_parentheses(const char* c)
+    /**
+     * Return a pointer just past the parenthesis that closes the one at c.
+     * Parentheses inside single-quoted strings are not counted.
+     */
+    static const char* find_closing_parentheses(const char* c, const char* last)
     {
         int level = 0;
         bool in_str = false;
 
         do
         {
-            if (*c == '\0')
+            if (c == last)
             {
                 throw parser_error("unterminated expression");
             }
@@ -1129,7 +2356,7 @@ private:
         return c;
     }
 
-    static expression parse_number(const char*& c)
+    static expression parse_number(const char*& c, const char* last)
     {
         const char* start = c;
         bool isdec = false;
@@ -1140,7 +2367,7 @@ private:
             ++c;
         }
 
-        while (std::isdigit(*c) || *c == '.' || *c == 'e' || *c == 'E')
+        while (c != last && (std::isdigit(*c) || *c == '.' || *c == 'e' || *c == 'E'))
         {
             if (*c == 'e' || *c == 'E')
             {
@@ -1161,113 +2388,177 @@ private:
             ++c;
         }
 
-        if (! (std::isspace(*c) || *c == '\0' || *c == ')'))
+        if (! is_terminator(c, last))
         {
             throw parser_error("syntax error: bad numeric literal");
         }
         else if (isdec || isexp)
         {
-            return expression(atof(std::string(start, c - start).data()));
+            return expression(to_f64(start, c));
         }
         else
         {
-            return expression(atoi(std::string(start, c - start).data()));
+            return expression(to_i32(start, c));
+        }
+    }
+
+    /**
+     * Convert a validated numeric literal. The range is not null-terminated,
+     * so it is copied to a buffer on the stack for strtod.
+     */
+    static double to_f64(const char* first, const char* last)
+    {
+        char buffer[64];
+        auto n = std::size_t(last - first);
+
+        if (n >= sizeof(buffer))
+        {
+            return std::strtod(std::string(first, last).data(), nullptr);
+        }
+        std::memcpy(buffer, first, n);
+        buffer[n] = '\0';
+        return std::strtod(buffer, nullptr);
+    }
+
+    /**
+     * Convert the digits in [first, last), with an optional sign, to an int.
+     * Throws parser_error if the value is out of range.
+     */
+    static int to_i32(const char* first, const char* last)
+    {
+        bool negative = *first == '-';
+        long long limit = negative ? INT_MAX + 1ll : INT_MAX;
+        long long value = 0;
+
+        if (*first == '+' || *first == '-')
+        {
+            ++first;
+        }
+        while (first != last)
+        {
+            value = value * 10 + (*first++ - '0');
+
+            if (value > limit)
+            {
+                throw parser_error("syntax error: integer out of range");
+            }
         }
+        return int(negative ? -value : value);
     }
 
-    static expression parse_symbol(const char*& c)
+    static expression parse_symbol(const char*& c, const char* last)
     {
         const char* start = c;
 
-        while (is_symbol_character(*c))
+        while (c != last && is_symbol_character(*c))
         {
             ++c;
         }
         return symbol(std::string(start, c));
     }
 
-    static expression parse_single_quoted_string(const char*& c)
+    static expression parse_single_quoted_string(const char*& c, const char* last)
     {
-        const char* start = c++;
+        const char* start = ++c;
 
-        while (*c != '\'')
+        while (c != last && *c != '\'')
         {
-            if (*c == '\0')
-            {
-                throw parser_error("syntax error: unterminated string");
-            }
             ++c;
         }
+        if (c == last)
+        {
+            throw parser_error("syntax error: unterminated string");
+        }
 
-        ++c;
+        auto value = expression(std::string(start, c++));
 
-        if (! (std::isspace(*c) || *c == '\0' || *c == ')'))
+        if (! is_terminator(c, last))
         {
             throw parser_error("syntax error: non-whitespace character following single-quoted string");
         }
-        return expression(std::string(start + 1, c - 1));
+        return value;
     }
 
-    static expression parse_expression(const char*& c)
+    /**
+     * Parse a sequence of parts in [c, last), calling emit with each one at
+     * the top level. Open tables are kept on an explicit stack.
+     */
+    template<typename Fn>
+    static void parse_sequence(const char* c, const char* last, Fn& emit)
     {
-        auto e = cont_t().transient();
-        auto end = find_closing_parentheses(c);
-        ++c;
+        struct frame_t
+        {
+            decltype(cont_t().transient()) parts;
+            ident keyword;
+        };
 
-        while (c != end)
+        auto stack = std::vector<frame_t>();
+        auto kw = ident();
+
+        auto push = [&stack, &emit] (expression e)
         {
-            if (*c == '\0')
-            {
-                throw parser_error("syntax error: unterminated expression");
-            }
-            else if (std::isspace(*c) || *c == ')')
+            if (stack.empty())
             {
-                ++c;
+                emit(std::move(e));
             }
             else
             {
-                e.push_back(parse_part(c));
+                stack.back().parts.push_back(std::move(e));
             }
-        }
-        return e.persistent();
-    }
+        };
 
-    static expression parse_part(const char*& c)
-    {
-        std::string kw;
-
-        while (*c != '\0')
+        while ((c = skip_space(c, last)) != last)
         {
-            if (std::isspace(*c))
+            if (*c == ')' && ! kw.empty())
+            {
+                throw parser_error("syntax error: keyword '" + kw.str() + "' has no value");
+            }
+            else if (*c == ')' && ! stack.empty())
             {
+                auto frame = std::move(stack.back());
+                stack.pop_back();
+                push(expression(frame.parts.persistent()).keyed(frame.keyword));
                 ++c;
             }
-            else if (const char* kwstart = get_named_part(c))
+            else if (const char* kwstart = get_named_part(c, last))
             {
                 kw = std::string(kwstart, c - 1);
             }
-            else if (is_number(c))
+            else if (is_number(c, last))
             {
-                return parse_number(c).keyed(kw);
+                push(parse_number(c, last).keyed(kw));
+                kw = ident();
             }
             else if (is_leading_symbol_character(*c))
             {
-                return parse_symbol(c).keyed(kw);
+                push(parse_symbol(c, last).keyed(kw));
+                kw = ident();
             }
             else if (*c == '\'')
             {
-                return parse_single_quoted_string(c).keyed(kw);
+                push(parse_single_quoted_string(c, last).keyed(kw));
+                kw = ident();
             }
             else if (*c == '(')
             {
-                return parse_expression(c).keyed(kw);
+                stack.push_back({cont_t().transient(), kw});
+                kw = ident();
+                ++c;
             }
             else
             {
                 throw parser_error("syntax error: unknown character '" + std::string(c, c + 1) + "'");
             }
         }
-        return expression();
+
+        if (! kw.empty())
+        {
+            throw parser_error("syntax error: keyword '" + kw.str() + "' has no value");
+        }
+        if (! stack.empty())
+        {
+            throw parser_error("syntax error: unterminated expression");
+        }
     }
 };
 
@@ -1277,7 +2568,7 @@ private:
 //=============================================================================
 crt::expression crt::parse(const std::string& source)
 {
-    return parser::parse(source.data());
+    return parser::parse(source.data(), source.data() + source.size());
 }
 
 crt::expression crt::parse(const char* source)
@@ -1290,6 +2581,8 @@ crt::expression crt::parse(const char* source)
 
 //=============================================================================
 #ifdef TEST_EXPRESSION
+#include <algorithm>
+#include <thread>
 #include "catch.hpp"
 #include "immer/map.hpp"
 using namespace crt;
@@ -1316,6 +2609,42 @@ TEST_CASE("expression passes basic sanity tests", "[expression]")
 
 
 
+TEST_CASE("idents are interned", "[expression]")
+{
+    REQUIRE(ident("a") == ident(std::string("a")));
+    REQUIRE(ident("a").id() == ident(std::string("a")).id());
+    REQUIRE(ident("a") != ident("b"));
+    REQUIRE(ident("") == ident());
+    REQUIRE(ident().empty());
+    REQUIRE(ident("a") < ident("b"));
+    REQUIRE(ident("abc").str() == "abc");
+    REQUIRE(symbol("x").keyed("y").key() == "y");
+    REQUIRE(symbol("x").symbols().count(ident("x")));
+
+    auto ids = std::vector<std::uintptr_t>(4);
+    auto threads = std::vector<std::thread>();
+
+    for (std::size_t i = 0; i < ids.size(); ++i)
+    {
+        threads.emplace_back([&ids, i]
+        {
+            for (int n = 0; n < 1000; ++n)
+            {
+                ident("k" + std::to_string(n));
+            }
+            ids[i] = ident("k999").id();
+        });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    REQUIRE(std::count(ids.begin(), ids.end(), ident("k999").id()) == 4);
+}
+
+
+
+
 TEST_CASE("nested expression can be constructed by hand", "[expression]")
 {
     expression e {
@@ -1339,12 +2668,87 @@ TEST_CASE("nested expression can be constructed by hand", "[expression]")
 
 
 
+TEST_CASE("expression copies, moves, and assigns every data type", "[expression]")
+{
+    auto f = expression([] (expression e) { return e; });
+    auto d = expression(data_t());
+    expression e = {1, 2.5, "str", symbol("sym"), f, d, {1, symbol("b")}};
+
+    auto g = e;
+    auto h = std::move(g);
+    REQUIRE(h != e); // functions are never equal
+    REQUIRE(h.without_part(4) == e.without_part(4));
+    REQUIRE(h.size() == 7);
+    REQUIRE(h.symbols().size() == 2);
+    REQUIRE(h.part(4).get_func() != nullptr);
+    REQUIRE(h.part(0).get_f64() == 0.0);
+    REQUIRE(h.part(2).get_sym().empty());
+    REQUIRE(h.part(3).get_str().empty());
+
+    h = h.part(6);
+    REQUIRE(h == expression{1, symbol("b")});
+    h = h.at(1);
+    REQUIRE(h.get_sym() == "b");
+    h = h;
+    REQUIRE(h.get_sym() == "b");
+    REQUIRE(h.symbols().count("b"));
+}
+
+
+
+
+TEST_CASE("rvalue-qualified methods agree with the const versions", "[expression]")
+{
+    auto e = parse("(a=1 b=(2 3))");
+    auto f = e;
+    REQUIRE(expression(e).keyed("k") == e.keyed("k"));
+    REQUIRE(expression(e).append(4) == e.append(4));
+    REQUIRE(expression(e).prepend(0) == e.prepend(0));
+    REQUIRE(expression(e).insert(1, 5) == e.insert(1, 5));
+    REQUIRE(expression(7).append(8) == expression(7).append(8));
+    REQUIRE(std::move(f).keyed("k").append(4).size() == 3);
+    REQUIRE(e == parse("(a=1 b=(2 3))"));
+}
+
+
+
+
+TEST_CASE("pool_allocator reuses freed blocks on the same thread", "[expression]")
+{
+    auto a = pool_allocator<double>();
+    auto p = a.allocate(1);
+    a.deallocate(p, 1);
+    REQUIRE(a.allocate(1) == p);
+    a.deallocate(p, 1);
+
+    auto q = a.allocate(3);
+    a.deallocate(q, 3);
+}
+
+
+
+
 TEST_CASE("expression can be converted to string", "[expression]")
 {
     REQUIRE(expression().unparse() == "()");
     REQUIRE(expression({}).unparse() == "()");
     REQUIRE(expression({1, 2, 3}).unparse() == "(1 2 3)");
     REQUIRE(expression({1, 2, 3}).unparse() == "(1 2 3)");
+    REQUIRE(expression({-2147483647 - 1, 0, 2.5, "s"}).keyed("a").unparse() == "a=(-2147483648 0 2.500000 's')");
+    REQUIRE(expression(1e300).unparse() == std::to_string(1e300));
+
+    auto e = parse("(a=(1 (2 3)) b='long string')");
+    auto buffer = std::string("> ");
+    REQUIRE(e.unparse(buffer));
+    REQUIRE(buffer == "> " + e.unparse());
+
+    buffer.clear();
+    REQUIRE_FALSE(e.unparse(buffer, 8));
+    REQUIRE(buffer == "(a=(1 (2...");
+
+    buffer.clear();
+    REQUIRE(e.unparse(buffer, std::string::npos, 2));
+    REQUIRE(buffer == "(a=(1 (...)) b='long string')");
 }
 
 
@@ -1439,6 +2843,72 @@ TEST_CASE("expression::resolve works correctly with the basic call adapter", "[e
 
 
 
+TEST_CASE("expression hashes agree with equality", "[expression]")
+{
+    REQUIRE(parse("(a 1 2.0 'x' (b c))").hash() == parse("(a 1 2.0 'x' (b c))").hash());
+    REQUIRE(parse("(a 1 2.0 'x' (b c))").hash() != parse("(a 1 2.0 'x' (b d))").hash());
+    REQUIRE(parse("(1 2)").hash() != parse("(2 1)").hash());
+    REQUIRE(expression(1).keyed("a").hash() != expression(1).hash());
+
+    auto f = expression([] (expression e) { return e; });
+    auto g = f;
+    REQUIRE(f.hash() == g.hash());
+    REQUIRE(f.hash() != expression([] (expression e) { return e; }).hash());
+    REQUIRE(std::hash<expression>()(parse("(a b)")) == parse("(a b)").hash());
+    REQUIRE(parse("(a (b c))").with_part(1, parse("(b d)")).hash() == parse("(a (b d))").hash());
+}
+
+
+
+
+TEST_CASE("hash_cons shares equal sub-tables", "[expression]")
+{
+    hash_cons hc;
+    auto e = hc(parse("((1 2) (1 2) ((1 2) x=(1 2)))"));
+    REQUIRE(e == parse("((1 2) (1 2) ((1 2) x=(1 2)))"));
+    REQUIRE(&e.at(0) == &e.at(1));
+    REQUIRE(&e.at(0) == &e.at(2).at(0));
+    REQUIRE(&e.at(0) != &e.at(2).at(1));
+    REQUIRE(&hc(parse("((1 2) 3)")).at(0) == &e.at(0));
+    REQUIRE(hc.size() == 6); // 1, 2, 3, (1 2), x=(1 2), ((1 2) x=(1 2))
+
+    auto f = expression([] (expression e) { return e; });
+    auto g = expression({f, expression({1, 2})});
+
+    for (int i = 0; i < 3; ++i)
+    {
+        REQUIRE(&hc(expression({g, 3})).at(0).at(1) == &e.at(0));
+    }
+    REQUIRE(hc.size() == 6);
+}
+
+
+
+
+TEST_CASE("memoizing_call_adapter caches calls to pure functions", "[expression]")
+{
+    auto calls = std::make_shared<int>(0);
+    auto f = expression([calls] (expression e) { ++*calls; return int(e.first()) * 2; });
+    auto s = immer::map<std::string, expression>().set("f", f).set("g", f).set("x", 3);
+    memoizing_call_adapter a(2);
+    a.mark_pure("f");
+
+    REQUIRE(int(parse("(f x)").resolve(s, a)) == 6);
+    REQUIRE(int(parse("(f 3)").resolve(s, a)) == 6);
+    REQUIRE(*calls == 1);
+    REQUIRE(a.hits() == 1);
+    REQUIRE(parse("(f 4)").resolve(s, a).get_i32() == 8);
+    REQUIRE(parse("(f 5)").resolve(s, a).get_i32() == 10);
+    REQUIRE(parse("(f 3)").resolve(s, a).get_i32() == 6);
+    REQUIRE(*calls == 4); // (f 3) was evicted
+    REQUIRE(parse("(g 3)").resolve(s, a).get_i32() == 6);
+    REQUIRE(parse("(g 3)").resolve(s, a).get_i32() == 6);
+    REQUIRE(*calls == 6); // g is not marked pure
+}
+
+
+
+
 TEST_CASE("basic strings can be parsed into expressions", "[parser]")
 {
     REQUIRE(parser::parse("a").dtype() == data_type::symbol);
@@ -1447,6 +2917,9 @@ TEST_CASE("basic strings can be parsed into expressions", "[parser]")
     REQUIRE(parser::parse("(a b c)").dtype() == data_type::table);
     REQUIRE(parser::parse("(a b c)").size() == 3);
     REQUIRE(parser::parse("(a b b c 1 2 'ant')").symbols().size() == 3);
+    REQUIRE(parser::parse("(a (b (c d)) (c a))").symbols().size() == 4);
+    REQUIRE(parser::parse("(a (b c))").with_part(1, 1).symbols().size() == 1);
+    REQUIRE(parser::parse("(a (b c))").replace("b", symbol("e")).symbols().count("e"));
     REQUIRE(parser::parse("(1 2 3)") == expression{1, 2, 3});
     REQUIRE(parser::parse("(1.0 2.0 3.0)") == expression{1.0, 2.0, 3.0});
     REQUIRE(parser::parse("a=1").key() == "a");
@@ -1481,6 +2954,10 @@ TEST_CASE("numeric constants parse correctly", "[parser]")
     REQUIRE_THROWS(parser::parse("1.2.2"));
     REQUIRE_THROWS(parser::parse("1e2.2"));
     REQUIRE_THROWS(parser::parse("13a"));
+    REQUIRE_THROWS_AS(parser::parse("3000000000"), parser_error);
+    REQUIRE_THROWS_AS(parser::parse("99999999999999999999"), parser_error);
+    REQUIRE(parser::parse("2147483647").get_i32() == 2147483647);
+    REQUIRE(parser::parse("-2147483648").get_i32() == INT_MIN);
 }
 
 
@@ -1521,6 +2998,48 @@ TEST_CASE("more complex expressions parse correctly", "[parser]")
     REQUIRE(parser::parse("(a '(a) (a) (a')").size() == 2);
     REQUIRE(parser::parse("(a 'a) (a) (a)')").size() == 2);
     REQUIRE_THROWS(parser::parse("(a 'a) (a) (a))"));
+    REQUIRE_THROWS(parser::parse("(a b"));
+    REQUIRE_THROWS(parser::parse("(a b))"));
+    REQUIRE_THROWS(parser::parse("(a= )"));
+    REQUIRE_THROWS_AS(parser::parse("a=1 b="), parser_error);
+    REQUIRE_THROWS_AS(parser::parse("(a=1 b= )"), parser_error);
+}
+
+
+
+
+TEST_CASE("the parser handles deep nesting and streams items", "[parser]")
+{
+    SECTION("deeply nested tables")
+    {
+        auto source = std::string(10000, '(') + "a" + std::string(10000, ')');
+        auto e = parser::parse(source.data(), source.data() + source.size());
+        REQUIRE(e.symbols().size() == 1);
+        REQUIRE(e.dtype() == data_type::table);
+    }
+    SECTION("the source does not need to be null-terminated")
+    {
+        const char* source = "(1 2 3) 4";
+        REQUIRE(parser::parse(source, source + 7) == expression{1, 2, 3});
+        REQUIRE(parser::parse(source + 3, source + 4).get_i32() == 2);
+    }
+    SECTION("items of a single table are emitted one at a time")
+    {
+        auto source = std::string("(a=1 b=(c d) c='x')");
+        auto keys = std::vector<std::string>();
+        parser::parse_items(source.data(), source.data() + source.size(), [&keys] (expression e)
+        {
+            keys.push_back(e.key());
+        });
+        REQUIRE(keys == std::vector<std::string>{"a", "b", "c"});
+    }
+    SECTION("top-level items are emitted one at a time")
+    {
+        auto source = std::string(" a=1 b=(c d) (e) ");
+        auto n = 0;
+        parser::parse_items(source.data(), source.data() + source.size(), [&n] (expression) { ++n; });
+        REQUIRE(n == 3);
+    }
 }
 
 
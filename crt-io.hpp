@@ -0,0 +1,132 @@
+#pragma once
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+
+
+//=============================================================================
+namespace crt {
+    class mapped_file;
+}
+
+
+
+
+//=============================================================================
+/**
+ * A read-only memory mapping of a whole file. The mapped characters can be
+ * handed straight to parser::parse or context::parse as a range, so large
+ * rule files are read without first being copied into a std::string.
+ */
+class crt::mapped_file
+{
+public:
+
+
+    //=========================================================================
+    /**
+     * Map the file at the given path. Throws std::runtime_error if the file
+     * cannot be opened or mapped.
+     */
+    mapped_file(const std::string& path)
+    {
+        int fd = ::open(path.data(), O_RDONLY);
+
+        if (fd == -1)
+        {
+            throw std::runtime_error("mapped_file: cannot open " + path);
+        }
+
+        struct stat st;
+
+        if (::fstat(fd, &st) == -1)
+        {
+            ::close(fd);
+            throw std::runtime_error("mapped_file: cannot stat " + path);
+        }
+
+        length = std::size_t(st.st_size);
+
+        if (length > 0)
+        {
+            void* addr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (addr == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::runtime_error("mapped_file: cannot map " + path);
+            }
+            ::madvise(addr, length, MADV_SEQUENTIAL);
+            addr_ = static_cast<const char*>(addr);
+        }
+        ::close(fd);
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    mapped_file(mapped_file&& other) : addr_(other.addr_), length(other.length)
+    {
+        other.addr_ = nullptr;
+        other.length = 0;
+    }
+
+    ~mapped_file()
+    {
+        if (addr_)
+        {
+            ::munmap(const_cast<char*>(addr_), length);
+        }
+    }
+
+
+    //=========================================================================
+    const char* data() const { return addr_; }
+    const char* begin() const { return addr_; }
+    const char* end() const { return addr_ + length; }
+    std::size_t size() const { return length; }
+
+
+private:
+    //=========================================================================
+    const char* addr_ = nullptr;
+    std::size_t length = 0;
+};
+
+
+
+
+//=============================================================================
+#ifdef TEST_IO
+#include <cstdio>
+#include <fstream>
+#include "catch.hpp"
+#include "crt-context.hpp"
+
+
+
+
+//=============================================================================
+TEST_CASE("mapped files can be parsed in place", "[mapped_file]")
+{
+    auto path = std::string("crt-io-test.crt");
+    std::ofstream(path) << "(a=1 b=(a 2) c='x')";
+
+    {
+        auto file = crt::mapped_file(path);
+        auto c = crt::context::parse(file.begin(), file.end());
+        REQUIRE(file.size() == 19);
+        REQUIRE(c.size() == 3);
+        REQUIRE(c.at("a").get_i32() == 1);
+        REQUIRE(c.at("c").get_str() == "x");
+    }
+    std::remove(path.data());
+    REQUIRE_THROWS(crt::mapped_file(path));
+}
+
+#endif // TEST_IO
@@ -0,0 +1,324 @@
+#pragma once
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "crt-expr.hpp"
+
+
+
+
+//=============================================================================
+namespace crt {
+    template<typename T> struct native_arg;
+    template<typename Fn, typename Signature> class typed_native;
+    class native_overloads;
+    template<typename Signature, typename Fn> func_t native(Fn fn);
+    template<typename R, typename... Args> func_t native(R (*fn)(Args...));
+    template<typename... Funcs> func_t overloaded(Funcs... funcs);
+}
+
+
+
+
+//=============================================================================
+/**
+ * Conversion of one resolved argument to a native parameter type. exact
+ * returns true when no coercion is needed, and convert does the conversion
+ * (numbers and strings are coerced as by as_i32, as_f64, and as_str). The
+ * primary template takes user data of type T and throws if the argument is
+ * anything else. Specialize it to accept other parameter types.
+ */
+template<typename T>
+struct crt::native_arg
+{
+    static bool exact(const expression& e) { return e.has_type<T>(); }
+    static const T& convert(const expression& e) { return e.check_data<T>(); }
+};
+
+template<>
+struct crt::native_arg<int>
+{
+    static bool exact(const expression& e) { return e.has_type(data_type::i32); }
+    static int convert(const expression& e) { return exact(e) ? e.get_i32() : e.as_i32(); }
+};
+
+template<>
+struct crt::native_arg<bool>
+{
+    static bool exact(const expression& e) { return e.has_type(data_type::i32); }
+    static bool convert(const expression& e) { return native_arg<int>::convert(e) != 0; }
+};
+
+template<>
+struct crt::native_arg<double>
+{
+    static bool exact(const expression& e) { return e.has_type(data_type::f64); }
+    static double convert(const expression& e) { return exact(e) ? e.get_f64() : e.as_f64(); }
+};
+
+template<>
+struct crt::native_arg<float>
+{
+    static bool exact(const expression& e) { return e.has_type(data_type::f64); }
+    static float convert(const expression& e) { return native_arg<double>::convert(e); }
+};
+
+template<>
+struct crt::native_arg<std::string>
+{
+    static bool exact(const expression& e) { return e.has_type(data_type::str); }
+    static std::string convert(const expression& e) { return e.as_str(); }
+};
+
+template<>
+struct crt::native_arg<crt::expression>
+{
+    static bool exact(const expression&) { return true; }
+    static const expression& convert(const expression& e) { return e; }
+};
+
+
+
+
+//=============================================================================
+/**
+ * A native_function calling fn with the given C++ signature. Each argument
+ * is converted by native_arg for its (decayed) parameter type, and the
+ * result is returned as an expression if it converts to one, or as user
+ * data otherwise.
+ */
+template<typename Fn, typename R, typename... Args>
+class crt::typed_native<Fn, R(Args...)> : public crt::native_function
+{
+public:
+    typed_native(Fn fn) : fn(std::move(fn)) {}
+
+    bool accepts(std::size_t n) const override
+    {
+        return n == sizeof...(Args);
+    }
+
+    bool exact(const expression* args, std::size_t n) const override
+    {
+        return n == sizeof...(Args) && exact_with(args, std::index_sequence_for<Args...>());
+    }
+
+    expression invoke(const expression* args, std::size_t n) const override
+    {
+        if (n != sizeof...(Args))
+        {
+            throw std::invalid_argument("native function expected "
+                + std::to_string(sizeof...(Args)) + " arguments, got "
+                + std::to_string(n));
+        }
+        return result(invoke_with(args, std::index_sequence_for<Args...>()),
+            std::is_convertible<R, expression>());
+    }
+
+private:
+    template<std::size_t... I>
+    bool exact_with(const expression* args, std::index_sequence<I...>) const
+    {
+        bool all = true;
+        (void) std::initializer_list<bool>{(all = all && native_arg<typename std::decay<Args>::type>::exact(args[I]))...};
+        return all;
+    }
+
+    template<std::size_t... I>
+    R invoke_with(const expression* args, std::index_sequence<I...>) const
+    {
+        return fn(native_arg<typename std::decay<Args>::type>::convert(args[I])...);
+    }
+
+    static expression result(R&& r, std::true_type) { return expression(std::forward<R>(r)); }
+    static expression result(R&& r, std::false_type) { return make_data(r); }
+
+    Fn fn;
+};
+
+
+
+
+//=============================================================================
+/**
+ * A native_function choosing among several by the arguments of each call:
+ * the first candidate whose parameter types match exactly is called, or
+ * failing that the first one taking that number of arguments.
+ */
+class crt::native_overloads : public crt::native_function
+{
+public:
+    native_overloads(std::vector<std::shared_ptr<const native_function>> candidates)
+    : candidates(std::move(candidates))
+    {
+    }
+
+    bool accepts(std::size_t n) const override
+    {
+        for (const auto& c : candidates)
+        {
+            if (c->accepts(n))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool exact(const expression* args, std::size_t n) const override
+    {
+        for (const auto& c : candidates)
+        {
+            if (c->exact(args, n))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    expression invoke(const expression* args, std::size_t n) const override
+    {
+        const native_function* fallback = nullptr;
+
+        for (const auto& c : candidates)
+        {
+            if (c->exact(args, n))
+            {
+                return c->invoke(args, n);
+            }
+            if (! fallback && c->accepts(n))
+            {
+                fallback = c.get();
+            }
+        }
+        if (! fallback)
+        {
+            throw std::invalid_argument("no overload takes " + std::to_string(n) + " arguments");
+        }
+        return fallback->invoke(args, n);
+    }
+
+private:
+    std::vector<std::shared_ptr<const native_function>> candidates;
+};
+
+
+
+
+//=============================================================================
+/**
+ * Return a function expression calling fn with the given signature, for
+ * example
+ *
+ *     auto f = crt::native<double(double, int)>([] (double x, int n) { return std::pow(x, n); });
+ *     auto rules = context().insert(expression(f).keyed("pow"));
+ *
+ * When a call adapter resolves a call to it, the arguments are resolved into
+ * an array and converted straight to the parameter types; no table is built.
+ */
+template<typename Signature, typename Fn>
+crt::func_t crt::native(Fn fn)
+{
+    return native_call{std::make_shared<typed_native<Fn, Signature>>(std::move(fn))};
+}
+
+
+/**
+ * Return a native function expression calling the given function pointer,
+ * whose signature is deduced.
+ */
+template<typename R, typename... Args>
+crt::func_t crt::native(R (*fn)(Args...))
+{
+    return native<R(Args...)>(fn);
+}
+
+
+/**
+ * Combine native functions (made by crt::native) into one, which picks an
+ * overload by the arguments. Throws std::invalid_argument if any of them is
+ * not a native function.
+ */
+template<typename... Funcs>
+crt::func_t crt::overloaded(Funcs... funcs)
+{
+    auto candidates = std::vector<std::shared_ptr<const native_function>>();
+
+    for (const func_t& f : {func_t(std::move(funcs))...})
+    {
+        auto call = f.target<native_call>();
+
+        if (! call)
+        {
+            throw std::invalid_argument("overloaded: expected native functions");
+        }
+        candidates.push_back(call->impl);
+    }
+    return native_call{std::make_shared<native_overloads>(std::move(candidates))};
+}
+
+
+
+
+//=============================================================================
+#ifdef TEST_NATIVE
+#include "catch.hpp"
+#include "crt-context.hpp"
+#include "crt-algorithm.hpp"
+
+
+
+
+//=============================================================================
+static int native_twice(int x)
+{
+    return 2 * x;
+}
+
+
+
+
+//=============================================================================
+TEST_CASE("native functions convert arguments and results", "[native]")
+{
+    using namespace crt;
+
+    auto rules = context::parse("(a=(scale 1.5 4) b=(twice 21) c=(join 'x' 3) d=(add 1 2) e=(add 1.0 2.0) f=(add 1 2 3) g=(add 1.0 2))")
+    .insert(expression(native<double(double, int)>([] (double x, int n) { return x * n; })).keyed("scale"))
+    .insert(expression(native(native_twice)).keyed("twice"))
+    .insert(expression(native<std::string(const std::string&, int)>([] (const std::string& s, int n) { return s + std::to_string(n); })).keyed("join"))
+    .insert(expression(overloaded(
+        native<int(int, int)>([] (int a, int b) { return a + b; }),
+        native<double(double, double)>([] (double a, double b) { return a + b + 0.5; }),
+        native<int(int, int, int)>([] (int a, int b, int c) { return a + b + c; }))).keyed("add"));
+
+    SECTION("through the call adapters")
+    {
+        auto prods = resolve_full(rules);
+        REQUIRE(prods.at("a").get_f64() == 6.0);
+        REQUIRE(prods.at("b").get_i32() == 42);
+        REQUIRE(prods.at("c").get_str() == "x3");
+        REQUIRE(prods.at("d").get_i32() == 3);
+        REQUIRE(prods.at("e").get_f64() == 3.5);
+        REQUIRE(prods.at("f").get_i32() == 6);
+        REQUIRE(prods.at("g").get_i32() == 3);
+
+        memoizing_call_adapter adapter;
+        adapter.mark_pure("add");
+        REQUIRE(resolve_full(rules, {}, adapter).at("e").get_f64() == 3.5);
+    }
+    SECTION("when called with a table")
+    {
+        REQUIRE(rules.at("scale").call(parse("(2.0 3)")).get_f64() == 6.0);
+        REQUIRE(rules.at("add").call(parse("(2 3)")).get_i32() == 5);
+        REQUIRE_THROWS_AS(rules.at("twice").call(parse("(1 2)")), std::invalid_argument);
+        REQUIRE_THROWS_AS(overloaded(func_t([] (expression e) { return e; })), std::invalid_argument);
+    }
+}
+
+#endif // TEST_NATIVE
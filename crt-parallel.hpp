@@ -0,0 +1,252 @@
+#pragma once
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+#include "crt-expr.hpp"
+#include "crt-context.hpp"
+
+
+
+
+//=============================================================================
+namespace crt {
+    template<typename Fn> void parallel_for(std::size_t n, Fn fn);
+    inline expression parse_parallel(const char* first, const char* last, unsigned num_threads=0);
+    inline context parse_context_parallel(const char* first, const char* last, unsigned num_threads=0);
+    inline std::string unparse_parallel(const expression& e, unsigned num_threads=0);
+}
+
+
+
+
+//=============================================================================
+/**
+ * Call fn(i) for each i in [0, n), on n - 1 new threads and the calling
+ * thread. If any call throws, the first exception (by index) is rethrown
+ * once all of them have finished.
+ */
+template<typename Fn>
+void crt::parallel_for(std::size_t n, Fn fn)
+{
+    auto errors = std::vector<std::exception_ptr>(n);
+    auto threads = std::vector<std::thread>();
+
+    auto run = [&fn, &errors] (std::size_t i)
+    {
+        try {
+            fn(i);
+        }
+        catch (...)
+        {
+            errors[i] = std::current_exception();
+        }
+    };
+
+    for (std::size_t i = 1; i < n; ++i)
+    {
+        threads.emplace_back(run, i);
+    }
+    if (n > 0)
+    {
+        run(0);
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    for (const auto& x : errors)
+    {
+        if (x)
+        {
+            std::rethrow_exception(x);
+        }
+    }
+}
+
+
+
+
+//=============================================================================
+namespace crt {
+    namespace parallel_detail {
+
+
+        /**
+         * The number of chunks to use for work of the given size. With no
+         * thread count given, each chunk gets at least min_size of the work.
+         */
+        inline std::size_t num_chunks(std::size_t size, unsigned num_threads, std::size_t min_size)
+        {
+            if (num_threads == 0)
+            {
+                auto hardware = std::max(1u, std::thread::hardware_concurrency());
+                return std::max(std::size_t(1), std::min(std::size_t(hardware), size / min_size));
+            }
+            return num_threads;
+        }
+
+
+        /**
+         * Split [first, last) at top-level part boundaries and parse the
+         * pieces concurrently, returning the parts of each piece in order.
+         */
+        inline std::vector<std::vector<expression>> parse_chunks(const char* first, const char* last, unsigned num_threads)
+        {
+            auto cuts = parser::split_parts(first, last, num_chunks(last - first, num_threads, 1 << 16));
+            auto chunks = std::vector<std::vector<expression>>(cuts.size() - 1);
+
+            parallel_for(chunks.size(), [&cuts, &chunks] (std::size_t i)
+            {
+                parser::parse_items(cuts[i], cuts[i + 1], [&chunks, i] (expression e)
+                {
+                    chunks[i].push_back(std::move(e));
+                });
+            });
+            return chunks;
+        }
+    }
+}
+
+
+
+
+//=============================================================================
+/**
+ * Parse the characters in [first, last) like parser::parse, but splitting
+ * the top level into pieces that are parsed on separate threads. With no
+ * thread count given, one thread is used per 64 KiB of source, up to the
+ * hardware concurrency.
+ */
+crt::expression crt::parse_parallel(const char* first, const char* last, unsigned num_threads)
+{
+    auto parts = cont_t().transient();
+
+    for (auto& chunk : parallel_detail::parse_chunks(first, last, num_threads))
+    {
+        for (auto& e : chunk)
+        {
+            parts.push_back(std::move(e));
+        }
+    }
+    if (parts.size() == 1)
+    {
+        return parts[0];
+    }
+    return parts.persistent();
+}
+
+
+/**
+ * Parse a context from the characters in [first, last) like context::parse,
+ * but parsing the rules on separate threads as in parse_parallel. The rules
+ * are then merged by one context::builder.
+ */
+crt::context crt::parse_context_parallel(const char* first, const char* last, unsigned num_threads)
+{
+    auto items = parser::item_range(first, last);
+    auto b = context::builder();
+
+    for (auto& chunk : parallel_detail::parse_chunks(items.first, items.second, num_threads))
+    {
+        for (auto& e : chunk)
+        {
+            if (! e.key().empty())
+            {
+                b.insert(std::move(e));
+            }
+        }
+    }
+    return b.build();
+}
+
+
+/**
+ * Return the same string as e.unparse(), unparsing the parts of a large
+ * table on separate threads. With no thread count given, each thread gets at
+ * least 4096 parts, up to the hardware concurrency.
+ */
+std::string crt::unparse_parallel(const expression& e, unsigned num_threads)
+{
+    auto n = parallel_detail::num_chunks(e.size(), num_threads, 4096);
+
+    if (! e.has_type(data_type::table) || n == 1)
+    {
+        return e.unparse();
+    }
+
+    auto pieces = std::vector<std::string>(n);
+
+    parallel_for(n, [&e, &pieces, n] (std::size_t i)
+    {
+        auto first = e.begin() + e.size() * i / n;
+        auto last = e.begin() + e.size() * (i + 1) / n;
+
+        for (auto part = first; part != last; ++part)
+        {
+            if (part != first)
+            {
+                pieces[i] += ' ';
+            }
+            (*part)->unparse(pieces[i]);
+        }
+    });
+
+    auto result = e.key().empty() ? std::string("(") : e.key().str() + "=(";
+
+    for (const auto& piece : pieces)
+    {
+        if (! piece.empty())
+        {
+            result += result.back() == '(' ? "" : " ";
+            result += piece;
+        }
+    }
+    return result + ")";
+}
+
+
+
+
+//=============================================================================
+#ifdef TEST_PARALLEL
+#include "catch.hpp"
+
+
+
+
+//=============================================================================
+TEST_CASE("parallel parse and unparse agree with the serial versions", "[parallel]")
+{
+    using namespace crt;
+
+    auto source = std::string("(");
+
+    for (int i = 0; i < 500; ++i)
+    {
+        auto n = std::to_string(i);
+        source += " r" + n + "= (add r" + std::to_string(i / 2) + " 'x ( " + n + "' " + n + ".5)";
+    }
+    source += " r0=1)";
+
+    for (unsigned threads : {1u, 3u, 8u})
+    {
+        auto cuts = parser::split_parts(source.data(), source.data() + source.size(), threads);
+        REQUIRE(cuts.size() <= threads + 1);
+
+        auto ctx = parse_context_parallel(source.data(), source.data() + source.size(), threads);
+        REQUIRE(ctx == context::parse(source));
+
+        auto e = parse_parallel(source.data(), source.data() + source.size(), threads);
+        REQUIRE(e == parse(source));
+        REQUIRE(unparse_parallel(e, threads) == e.unparse());
+        REQUIRE(unparse_parallel(e.keyed("k"), threads) == e.keyed("k").unparse());
+    }
+
+    auto flat = std::string(source.begin() + 1, source.end() - 1);
+    REQUIRE(parse_parallel(flat.data(), flat.data() + flat.size(), 4) == parse(flat));
+    REQUIRE_THROWS_AS(parse_parallel(source.data(), source.data() + source.size() - 1, 4), parser_error);
+}
+
+#endif // TEST_PARALLEL
@@ -0,0 +1,349 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "crt-expr.hpp"
+
+
+
+
+//=============================================================================
+namespace crt {
+    class profiler;
+}
+
+
+
+
+//=============================================================================
+/**
+ * An instrument that records, for each rule key, the number of evaluations,
+ * the wall time spent evaluating, the time spent waiting in a worker pool
+ * queue, and the memoizing_call_adapter hits and misses during evaluation.
+ * It also keeps one trace event per evaluation, which can be exported in
+ * the Chrome trace event format (load it in chrome://tracing or Perfetto).
+ * Queue times are matched to evaluations by resolve and rule key, so one
+ * profiler may observe several resolves of the same rules at once.
+ *
+ *     crt::profiler prof;
+ *     crt::instrument::install(&prof);
+ *     auto prods = crt::resolve_parallel(rules, {}, pool);
+ *     crt::instrument::install(nullptr);
+ *     prof.write_chrome_trace(std::ofstream("trace.json"));
+ */
+class crt::profiler : public crt::instrument
+{
+public:
+
+
+    //=========================================================================
+    using clock_t = std::chrono::steady_clock;
+
+    struct rule_stats
+    {
+        std::size_t evaluations = 0;
+        std::size_t cache_hits = 0;
+        std::size_t cache_misses = 0;
+        double wall_time = 0.0;
+        double queued_time = 0.0;
+    };
+
+
+    //=========================================================================
+    profiler() : epoch(clock_t::now()) {}
+    profiler(const profiler&) = delete;
+    profiler& operator=(const profiler&) = delete;
+
+
+    /**
+     * Return the statistics for every rule that has been evaluated. Times
+     * are in seconds.
+     */
+    std::unordered_map<ident, rule_stats> stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return rules;
+    }
+
+
+    /**
+     * Return the statistics for a single rule.
+     */
+    rule_stats stats(ident key) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto s = rules.find(key);
+        return s == rules.end() ? rule_stats() : s->second;
+    }
+
+
+    /**
+     * Write the recorded evaluations as Chrome trace "complete" events, one
+     * per evaluation, with timestamps in microseconds since the profiler was
+     * created.
+     */
+    void write_chrome_trace(std::ostream& os) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto separator = "\n";
+
+        os << "{\"traceEvents\":[";
+
+        for (const auto& event : events)
+        {
+            os << separator
+               << "{\"name\":\"" << escape(event.key.str()) << "\""
+               << ",\"cat\":\"rule\",\"ph\":\"X\",\"pid\":1"
+               << ",\"tid\":" << event.thread
+               << ",\"ts\":" << microseconds(event.start - epoch)
+               << ",\"dur\":" << microseconds(event.finish - event.start)
+               << ",\"args\":{\"queued_us\":" << microseconds(event.queued) << "}}";
+            separator = ",\n";
+        }
+        os << "\n]}\n";
+    }
+
+    template<typename Stream>
+    void write_chrome_trace(Stream&& os) const
+    {
+        write_chrome_trace(static_cast<std::ostream&>(os));
+    }
+
+
+    /**
+     * Forget everything recorded so far.
+     */
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        rules.clear();
+        queued.clear();
+        events.clear();
+    }
+
+
+    //=========================================================================
+    void rule_queued(const ident& key, std::uintptr_t run) override
+    {
+        auto now = clock_t::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        queued[run][key] = now;
+    }
+
+    void rule_started(const ident& key, std::uintptr_t run) override
+    {
+        active().push_back({key, run, clock_t::now()});
+    }
+
+    void rule_finished(const ident& key) override
+    {
+        if (active().empty())
+        {
+            return;
+        }
+
+        auto now = clock_t::now();
+        auto frame = active().back();
+        active().pop_back();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& s = rules[key];
+        auto wait = clock_t::duration::zero();
+        auto r = queued.find(frame.run);
+
+        if (r != queued.end() && r->second.count(key))
+        {
+            wait = frame.start - r->second.at(key);
+            r->second.erase(key);
+
+            if (r->second.empty())
+            {
+                queued.erase(r);
+            }
+        }
+
+        s.evaluations += 1;
+        s.wall_time += seconds(now - frame.start);
+        s.queued_time += seconds(wait);
+        events.push_back({key, thread_index(), frame.start, now, wait});
+    }
+
+    void cache_lookup(bool hit) override
+    {
+        if (active().empty())
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& s = rules[active().back().key];
+        ++(hit ? s.cache_hits : s.cache_misses);
+    }
+
+
+private:
+    //=========================================================================
+    struct frame_t
+    {
+        ident key;
+        std::uintptr_t run;
+        clock_t::time_point start;
+    };
+
+    struct event_t
+    {
+        ident key;
+        int thread;
+        clock_t::time_point start;
+        clock_t::time_point finish;
+        clock_t::duration queued;
+    };
+
+
+    /**
+     * The rules being evaluated on the calling thread, innermost last.
+     */
+    static std::vector<frame_t>& active()
+    {
+        thread_local std::vector<frame_t> frames;
+        return frames;
+    }
+
+    int thread_index()
+    {
+        auto t = threads.emplace(std::this_thread::get_id(), int(threads.size()));
+        return t.first->second;
+    }
+
+    static double seconds(clock_t::duration d)
+    {
+        return std::chrono::duration<double>(d).count();
+    }
+
+    static long long microseconds(clock_t::duration d)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    }
+
+    static std::string escape(const std::string& s)
+    {
+        auto result = std::string();
+
+        for (auto c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                result += '\\';
+            }
+            if (static_cast<unsigned char>(c) >= 0x20)
+            {
+                result += c;
+            }
+        }
+        return result;
+    }
+
+    mutable std::mutex mutex;
+    clock_t::time_point epoch;
+    std::unordered_map<ident, rule_stats> rules;
+    std::unordered_map<std::uintptr_t, std::unordered_map<ident, clock_t::time_point>> queued;
+    std::unordered_map<std::thread::id, int> threads;
+    std::vector<event_t> events;
+};
+
+
+
+
+//=============================================================================
+#ifdef TEST_PROFILER
+#include <sstream>
+#include <thread>
+#include "catch.hpp"
+#include "crt-algorithm.hpp"
+
+
+
+
+//=============================================================================
+TEST_CASE("profiler records rule evaluations", "[profiler]")
+{
+    using namespace crt;
+
+    auto add = [] (expression e)
+    {
+        return expression(e.first().get_i32() + e.second().get_i32());
+    };
+    auto rules = context::parse("(a=(add 1 2) b=(add a a) c=(add a a) d=(add b c))")
+    .insert(expression(func_t(add)).keyed("add"));
+
+    SECTION("in resolve_full, with cache hits")
+    {
+        profiler prof;
+        memoizing_call_adapter adapter;
+        adapter.mark_pure("add");
+
+        instrument::install(&prof);
+        auto prods = resolve_full(rules, {}, adapter);
+        instrument::install(nullptr);
+
+        REQUIRE(prods.at("d").get_i32() == 12);
+        REQUIRE(prof.stats().size() == 4);
+        REQUIRE(prof.stats("a").evaluations == 1);
+        REQUIRE(prof.stats("a").cache_misses == 1);
+        REQUIRE(prof.stats("b").cache_hits + prof.stats("c").cache_hits == 1);
+        REQUIRE(prof.stats("add").evaluations == 0);
+    }
+    SECTION("in resolve_parallel, with a trace export")
+    {
+        profiler prof;
+        worker_pool pool(2);
+
+        instrument::install(&prof);
+        auto prods = resolve_parallel(rules, {}, pool);
+        instrument::install(nullptr);
+
+        REQUIRE(prods.at("d").get_i32() == 12);
+
+        for (auto key : {"a", "b", "c", "d"})
+        {
+            REQUIRE(prof.stats(key).evaluations == 1);
+            REQUIRE(prof.stats(key).queued_time >= 0.0);
+        }
+
+        std::ostringstream trace;
+        prof.write_chrome_trace(trace);
+        REQUIRE(trace.str().find("\"traceEvents\"") != std::string::npos);
+        REQUIRE(trace.str().find("\"name\":\"d\"") != std::string::npos);
+    }
+    SECTION("in concurrent resolves of the same rules")
+    {
+        profiler prof;
+        worker_pool pool(4);
+
+        instrument::install(&prof);
+        auto threads = std::vector<std::thread>();
+
+        for (int i = 0; i < 4; ++i)
+        {
+            threads.emplace_back([&] { resolve_parallel(rules, {}, pool); });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        instrument::install(nullptr);
+
+        for (auto key : {"a", "b", "c", "d"})
+        {
+            REQUIRE(prof.stats(key).evaluations == 4);
+            REQUIRE(prof.stats(key).queued_time >= 0.0);
+        }
+    }
+}
+
+#endif // TEST_PROFILER
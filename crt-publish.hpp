@@ -0,0 +1,323 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include "crt-expr.hpp"
+#include "crt-context.hpp"
+
+
+
+
+//=============================================================================
+namespace crt {
+    class publisher;
+    inline context::set_t diff(const context& before, const context& after);
+}
+
+
+
+
+//=============================================================================
+/**
+ * Return the keys that are in one context but not the other, or whose
+ * expressions differ. This is O(N) in the sizes of the contexts.
+ */
+crt::context::set_t crt::diff(const context& before, const context& after)
+{
+    auto changed = context::set_t().transient();
+
+    for (const auto& item : after)
+    {
+        if (! before.count(item.first) || before.at(item.first) != item.second)
+        {
+            changed.insert(item.first);
+        }
+    }
+    for (const auto& item : before)
+    {
+        if (! after.count(item.first))
+        {
+            changed.insert(item.first);
+        }
+    }
+    return changed.persistent();
+}
+
+
+
+
+//=============================================================================
+/**
+ * Publishes versioned snapshots of a context (typically products) from
+ * writer threads to any number of reader threads. A reader calls latest to
+ * get the newest snapshot, which is immutable; it never takes the
+ * publisher's lock, only an atomic load of a shared_ptr, and it never sees
+ * a partly-updated context. A reader that keeps the snapshot it last
+ * processed can ask the next one which keys changed since then:
+ *
+ *     auto seen = std::shared_ptr<const crt::publisher::snapshot>();
+ *
+ *     while (running)
+ *     {
+ *         auto s = pub.latest();
+ *         for (const auto& key : s->changes_since(seen.get())) ...
+ *         seen = s;
+ *     }
+ *
+ * Each snapshot records the keys changed from the version before it, and
+ * chains to the records of up to history earlier versions, so that
+ * changes_since is proportional to the number of changes. For older
+ * snapshots it falls back to diff.
+ */
+class crt::publisher
+{
+public:
+
+
+    //=========================================================================
+    class snapshot
+    {
+    public:
+        std::uint64_t version() const { return number; }
+        const context& products() const { return prods; }
+
+
+        /**
+         * Return the keys that changed between an earlier snapshot and this
+         * one, or every key if since is null.
+         */
+        context::set_t changes_since(const snapshot* since) const
+        {
+            if (! since)
+            {
+                return diff(context(), prods);
+            }
+
+            auto keys = context::set_t().transient();
+
+            for (auto d = deltas.get(); d && d->version > since->number; d = d->previous.get())
+            {
+                for (const auto& k : d->keys)
+                {
+                    keys.insert(k);
+                }
+                if (d->version == since->number + 1)
+                {
+                    return keys.persistent();
+                }
+            }
+            return since->number == number ? context::set_t() : diff(since->prods, prods);
+        }
+
+
+    private:
+        friend class publisher;
+
+        struct delta_t
+        {
+            std::uint64_t version;
+            std::size_t depth;
+            context::set_t keys;
+            std::shared_ptr<const delta_t> previous;
+        };
+
+        std::uint64_t number = 0;
+        context prods;
+        std::shared_ptr<const delta_t> deltas;
+    };
+
+
+    //=========================================================================
+    publisher(std::size_t history=64)
+    : history(history)
+    , current(std::make_shared<const snapshot>())
+    {
+    }
+
+    publisher(const publisher&) = delete;
+    publisher& operator=(const publisher&) = delete;
+
+
+    /**
+     * Return the newest snapshot. The first one, before anything has been
+     * published, is version 0 with an empty context.
+     */
+    std::shared_ptr<const snapshot> latest() const
+    {
+        return std::atomic_load(&current);
+    }
+
+    std::uint64_t version() const
+    {
+        return latest()->version();
+    }
+
+
+    /**
+     * Publish a new version of the context, with the given keys recorded as
+     * the ones changed from the previous version (for example the fresh
+     * keys passed to a resolve_parallel callback). Returns the new version.
+     */
+    std::uint64_t publish(context products, context::set_t changed)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return append(std::move(products), std::move(changed));
+    }
+
+
+    /**
+     * Publish a new version of the context, finding the changed keys with
+     * diff against the previous version. The diff is taken under the lock,
+     * so that it is against the version this one follows.
+     */
+    std::uint64_t publish(context products)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto changed = diff(std::atomic_load(&current)->products(), products);
+        return append(std::move(products), std::move(changed));
+    }
+
+
+private:
+    //=========================================================================
+    std::uint64_t append(context products, context::set_t changed)
+    {
+        auto prev = std::atomic_load(&current);
+        auto next = std::make_shared<snapshot>();
+        auto depth = prev->deltas ? prev->deltas->depth + 1 : 1;
+
+        next->number = prev->number + 1;
+        next->prods = std::move(products);
+        next->deltas = std::make_shared<const snapshot::delta_t>(snapshot::delta_t{
+            next->number,
+            depth > history ? 1 : depth,
+            std::move(changed),
+            depth > history ? nullptr : prev->deltas});
+
+        std::atomic_store(&current, std::shared_ptr<const snapshot>(std::move(next)));
+        return prev->number + 1;
+    }
+
+    std::size_t history;
+    std::shared_ptr<const snapshot> current;
+    std::mutex mutex;
+};
+
+
+
+
+//=============================================================================
+#ifdef TEST_PUBLISH
+#include <thread>
+#include "catch.hpp"
+
+
+
+
+//=============================================================================
+TEST_CASE("publisher hands out consistent snapshots and change sets", "[publish]")
+{
+    using namespace crt;
+
+    SECTION("changes accumulate between versions")
+    {
+        publisher pub(2);
+        auto v0 = pub.latest();
+        REQUIRE(v0->version() == 0);
+
+        pub.publish(context::parse("(a=1 b=2)"));
+        auto v1 = pub.latest();
+        pub.publish(context::parse("(a=1 b=3 c=4)"));
+        pub.publish(context::parse("(b=3 c=4)"));
+        auto v3 = pub.latest();
+
+        REQUIRE(v3->version() == 3);
+        REQUIRE(v3->changes_since(nullptr).size() == 2);
+        REQUIRE(v3->changes_since(v1.get()) == context::set_t().insert("a").insert("b").insert("c"));
+        REQUIRE(v3->changes_since(v3.get()).empty());
+
+        pub.publish(v3->products().insert(expression(5).keyed("d")), context::set_t().insert("d"));
+        REQUIRE(pub.latest()->changes_since(v3.get()) == context::set_t().insert("d"));
+        REQUIRE(pub.latest()->changes_since(v0.get()).size() == 3); // beyond the history, by diff
+    }
+    SECTION("readers on other threads see whole versions")
+    {
+        publisher pub;
+        std::atomic<bool> done(false);
+        std::atomic<int> torn(0);
+
+        auto reader = [&]
+        {
+            auto seen = std::shared_ptr<const publisher::snapshot>();
+
+            while (! done)
+            {
+                auto s = pub.latest();
+                auto v = int(s->version());
+
+                if (v > 0 && s->products().at("x").get_i32() != v)
+                {
+                    ++torn;
+                }
+                if (! seen || seen->version() != s->version())
+                {
+                    s->changes_since(seen.get());
+                }
+                seen = s;
+            }
+        };
+        std::thread r1(reader), r2(reader);
+
+        for (int i = 1; i <= 200; ++i)
+        {
+            pub.publish(context().insert(expression(i).keyed("x")).insert(expression(-i).keyed("y")));
+        }
+        done = true;
+        r1.join();
+        r2.join();
+
+        REQUIRE(torn == 0);
+        REQUIRE(pub.version() == 200);
+    }
+    SECTION("change sets from concurrent writers miss nothing")
+    {
+        publisher pub;
+        std::atomic<int> writers(2);
+        std::atomic<int> missed(0);
+
+        auto writer = [&] (const char* key)
+        {
+            for (int i = 1; i <= 200; ++i)
+            {
+                pub.publish(context().insert(expression(i).keyed(key)));
+            }
+            --writers;
+        };
+        auto reader = [&]
+        {
+            auto seen = pub.latest();
+
+            while (writers > 0)
+            {
+                auto s = pub.latest();
+                auto changes = s->changes_since(seen.get());
+
+                for (const auto& k : diff(seen->products(), s->products()))
+                {
+                    missed += ! changes.count(k);
+                }
+                seen = s;
+            }
+        };
+        std::thread r(reader), a(writer, "a"), b(writer, "b");
+        a.join();
+        b.join();
+        r.join();
+
+        REQUIRE(missed == 0);
+        REQUIRE(pub.version() == 400);
+    }
+}
+
+#endif // TEST_PUBLISH
@@ -0,0 +1,695 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "crt-expr.hpp"
+#include "crt-context.hpp"
+#include "crt-io.hpp"
+
+
+
+
+//=============================================================================
+namespace crt {
+    class snapshot_writer;
+    class snapshot_reader;
+
+
+    //=========================================================================
+    class snapshot_error : public std::runtime_error
+    {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+};
+
+
+
+
+//=============================================================================
+/**
+ * Binary snapshot format
+ * ======================
+ *
+ * A snapshot begins with the four bytes "CRTB" and a varint format version,
+ * followed by any number of expressions and contexts, in an order known to
+ * the reader. Integers are varints (signed ones are zigzag encoded), doubles
+ * are 8 bytes little-endian. Each distinct ident is written in full the
+ * first time it appears, and as an index into the table of idents seen so
+ * far after that.
+ *
+ * An expression is a byte holding its data_type, with the high bit set if it
+ * has a keyword (which follows as an ident), and then its value. A context is
+ * its item count, followed by each item and the keys of its outgoing edges,
+ * so loading it does not recompute the DAG.
+ *
+ * Functions cannot be written, but a context holding them can be written
+ * with them left out or substituted. A user_data is written with its type
+ * name and the bytes produced by type_info<T>::serialize, if the type_info
+ * has
+ *
+ *     static void serialize(const T&, std::string& out);
+ *     static T deserialize(const char* data, std::size_t size);
+ *
+ * and the reader must be told about the type with add_type<T>(). Otherwise,
+ * the user_data is written as its to_table() expression.
+ */
+class crt::snapshot_writer
+{
+public:
+
+
+    //=========================================================================
+    snapshot_writer()
+    {
+        buffer.append("CRTB", 4);
+        write_varint(version);
+    }
+
+    using substitute_t = std::function<expression(const expression&)>;
+
+
+    /**
+     * Write an expression or a context. If it cannot be written (because it
+     * holds a function), snapshot_error is thrown and nothing is appended.
+     */
+    void write(const expression& e)
+    {
+        atomically([this, &e] { write_expression(e); });
+    }
+
+    void write(const context& c)
+    {
+        write(c, [] (const expression& e) -> expression
+        {
+            throw snapshot_error("snapshot: functions cannot be serialized (item " + e.key().str() + ")");
+        });
+    }
+
+
+    /**
+     * Write a context whose items may hold functions, such as products: each
+     * item holding a function is written as substitute(item) instead, or is
+     * left out if substitute is null.
+     */
+    void write(const context& c, const substitute_t& substitute)
+    {
+        atomically([this, &c, &substitute]
+        {
+            auto n = c.size();
+
+            if (! substitute)
+            {
+                for (const auto& item : c)
+                {
+                    n -= item.second.has_type(data_type::function);
+                }
+            }
+            write_varint(n);
+
+            for (const auto& item : c)
+            {
+                auto e = item.second.keyed(item.first);
+
+                if (e.has_type(data_type::function))
+                {
+                    if (! substitute)
+                    {
+                        continue;
+                    }
+                    e = substitute(e).keyed(item.first);
+                }
+
+                auto out = c.get_outgoing(item.first);
+                write_expression(e);
+                write_varint(out.size());
+
+                for (const auto& k : out)
+                {
+                    write_ident(k);
+                }
+            }
+        });
+    }
+
+    const std::string& str() const
+    {
+        return buffer;
+    }
+
+    void save(const std::string& path) const
+    {
+        auto outf = std::ofstream(path, std::ios::binary);
+        outf.write(buffer.data(), buffer.size());
+
+        if (! outf)
+        {
+            throw snapshot_error("snapshot: cannot write " + path);
+        }
+    }
+
+    static const std::uint64_t version = 1;
+
+
+private:
+    //=========================================================================
+    /**
+     * Call fn, and if it throws, restore the buffer and the ident table to
+     * what they were before rethrowing.
+     */
+    template<typename Fn>
+    void atomically(Fn fn)
+    {
+        auto size = buffer.size();
+        auto count = idents.size();
+
+        try {
+            fn();
+        }
+        catch (...)
+        {
+            buffer.resize(size);
+
+            for (auto i = idents.begin(); i != idents.end();)
+            {
+                i = i->second >= count ? idents.erase(i) : std::next(i);
+            }
+            throw;
+        }
+    }
+
+    void write_expression(const expression& e)
+    {
+        if (e.type == data_type::data && e.valdata && ! e.valdata->serialize(scratch.assign("")))
+        {
+            write_expression(e.valdata->to_table().keyed(e.keyword));
+            return;
+        }
+
+        auto tag = std::uint8_t(e.type);
+        buffer.push_back(char(e.keyword.empty() ? tag : tag | 0x80));
+
+        if (! e.keyword.empty())
+        {
+            write_ident(e.keyword);
+        }
+
+        switch (e.type)
+        {
+            case data_type::none     : break;
+            case data_type::i32      : write_varint(zigzag(e.vali32)); break;
+            case data_type::f64      : write_f64(e.valf64); break;
+            case data_type::str      : write_string(e.valstr.get()); break;
+            case data_type::symbol   : write_ident(e.valsym.name); break;
+            case data_type::data     : write_data(e.valdata); break;
+            case data_type::function : throw snapshot_error("snapshot: functions cannot be serialized");
+            case data_type::table:
+            {
+                write_varint(e.size());
+
+                for (const auto& part : e)
+                {
+                    write_expression(*part);
+                }
+                break;
+            }
+        }
+    }
+
+    static std::uint64_t zigzag(int v)
+    {
+        return std::uint32_t((std::uint32_t(v) << 1) ^ std::uint32_t(v < 0 ? -1 : 0));
+    }
+
+    void write_varint(std::uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            buffer.push_back(char(v | 0x80));
+            v >>= 7;
+        }
+        buffer.push_back(char(v));
+    }
+
+    void write_f64(double v)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+
+        for (int i = 0; i < 8; ++i)
+        {
+            buffer.push_back(char(bits >> (8 * i)));
+        }
+    }
+
+    void write_string(const std::string& s)
+    {
+        write_varint(s.size());
+        buffer.append(s);
+    }
+
+    void write_ident(const ident& k)
+    {
+        auto index = idents.size();
+        auto inserted = idents.emplace(k, index);
+
+        write_varint(inserted.first->second);
+
+        if (inserted.second)
+        {
+            write_string(k.str());
+        }
+    }
+
+    void write_data(const data_t& d)
+    {
+        if (! d)
+        {
+            write_ident(ident());
+            return;
+        }
+        write_ident(ident(d->type_name()));
+        write_string(scratch);
+    }
+
+    std::string buffer;
+    std::string scratch;
+    std::unordered_map<ident, std::uint64_t> idents;
+};
+
+
+
+
+//=============================================================================
+/**
+ * Reads expressions and contexts back from a snapshot, in the order they
+ * were written. The reader works on a range of characters, such as a
+ * mapped_file, and copies only the strings it needs to.
+ */
+class crt::snapshot_reader
+{
+public:
+
+
+    //=========================================================================
+    snapshot_reader(const char* first, const char* last) : c(first), last(last)
+    {
+        need(4);
+
+        if (std::memcmp(c, "CRTB", 4) != 0)
+        {
+            throw snapshot_error("snapshot: bad magic number");
+        }
+        c += 4;
+
+        if (read_varint() != snapshot_writer::version)
+        {
+            throw snapshot_error("snapshot: unsupported version");
+        }
+    }
+
+
+    /**
+     * Allow user_data of type T to be read. type_info<T> must provide a
+     * deserialize hook.
+     */
+    template<typename T>
+    snapshot_reader& add_type()
+    {
+        loaders[ident(type_info<T>::name())] = [] (const char* data, std::size_t size)
+        {
+            return make_data(type_info<T>::deserialize(data, size));
+        };
+        return *this;
+    }
+
+    /**
+     * Read an expression. Nested tables are read with an explicit stack,
+     * and tables nested more than max_depth levels deep are rejected with
+     * snapshot_error, so that corrupt or hostile data cannot overflow the
+     * call stack (expressions are destroyed recursively).
+     */
+    expression read_expression()
+    {
+        struct frame_t
+        {
+            ident keyword;
+            std::uint64_t remaining;
+            decltype(cont_t().transient()) parts;
+        };
+
+        auto stack = std::vector<frame_t>();
+
+        while (true)
+        {
+            need(1);
+
+            auto tag = std::uint8_t(*c++);
+            auto kw = tag & 0x80 ? read_ident() : ident();
+            auto e = expression();
+
+            if (data_type(tag & 0x7f) == data_type::table)
+            {
+                auto n = read_varint();
+
+                if (n > 0)
+                {
+                    if (stack.size() == max_depth)
+                    {
+                        throw snapshot_error("snapshot: tables nested too deeply");
+                    }
+                    stack.push_back({kw, n, cont_t().transient()});
+                    continue;
+                }
+                e = expression(cont_t()).keyed(kw);
+            }
+            else
+            {
+                e = read_value(data_type(tag & 0x7f)).keyed(kw);
+            }
+
+            while (true)
+            {
+                if (stack.empty())
+                {
+                    return e;
+                }
+
+                auto& top = stack.back();
+                top.parts.push_back(std::move(e));
+
+                if (--top.remaining > 0)
+                {
+                    break;
+                }
+                e = expression(top.parts.persistent()).keyed(top.keyword);
+                stack.pop_back();
+            }
+        }
+    }
+
+    context read_context()
+    {
+        auto n = read_varint();
+        auto items = context::map_t().transient();
+        auto incoming = context::dag_t().transient();
+        auto outgoing = context::dag_t().transient();
+
+        for (std::uint64_t i = 0; i < n; ++i)
+        {
+            auto e = read_expression();
+            auto m = read_varint();
+            auto out = context::set_t().transient();
+
+            for (std::uint64_t j = 0; j < m; ++j)
+            {
+                out.insert(read_ident());
+            }
+            incoming.set(e.key(), e.symbols());
+            outgoing.set(e.key(), out.persistent());
+            items.set(e.key(), std::move(e));
+        }
+        return context(items.persistent(), incoming.persistent(), outgoing.persistent());
+    }
+
+    bool at_end() const
+    {
+        return c == last;
+    }
+
+    static const std::size_t max_depth = 10000;
+
+
+private:
+    //=========================================================================
+    expression read_value(data_type type)
+    {
+        switch (type)
+        {
+            case data_type::none     : return expression();
+            case data_type::i32      : return expression(unzigzag(read_varint()));
+            case data_type::f64      : return expression(read_f64());
+            case data_type::str      : return expression(read_string());
+            case data_type::symbol   : return symbol(read_ident());
+            case data_type::data     : return expression(read_data());
+            default: throw snapshot_error("snapshot: bad expression tag");
+        }
+    }
+
+    void need(std::uint64_t n) const
+    {
+        if (std::uint64_t(last - c) < n)
+        {
+            throw snapshot_error("snapshot: unexpected end of data");
+        }
+    }
+
+    std::uint64_t read_varint()
+    {
+        std::uint64_t v = 0;
+
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            need(1);
+            auto b = std::uint8_t(*c++);
+            v |= std::uint64_t(b & 0x7f) << shift;
+
+            if (! (b & 0x80))
+            {
+                return v;
+            }
+        }
+        throw snapshot_error("snapshot: bad varint");
+    }
+
+    static int unzigzag(std::uint64_t v)
+    {
+        return int(std::uint32_t(v >> 1) ^ -std::uint32_t(v & 1));
+    }
+
+    double read_f64()
+    {
+        need(8);
+        std::uint64_t bits = 0;
+
+        for (int i = 0; i < 8; ++i)
+        {
+            bits |= std::uint64_t(std::uint8_t(*c++)) << (8 * i);
+        }
+
+        double v;
+        std::memcpy(&v, &bits, sizeof(v));
+        return v;
+    }
+
+    std::pair<const char*, std::size_t> read_bytes()
+    {
+        auto n = read_varint();
+        need(n);
+        auto start = c;
+        c += n;
+        return {start, std::size_t(n)};
+    }
+
+    std::string read_string()
+    {
+        auto b = read_bytes();
+        return std::string(b.first, b.second);
+    }
+
+    ident read_ident()
+    {
+        auto index = read_varint();
+
+        if (index < idents.size())
+        {
+            return idents[index];
+        }
+        else if (index == idents.size())
+        {
+            idents.push_back(read_string());
+            return idents.back();
+        }
+        throw snapshot_error("snapshot: bad ident index");
+    }
+
+    data_t read_data()
+    {
+        auto name = read_ident();
+
+        if (name.empty())
+        {
+            return data_t();
+        }
+
+        auto b = read_bytes();
+        auto loader = loaders.find(name);
+
+        if (loader == loaders.end())
+        {
+            throw snapshot_error("snapshot: no loader for user_data type " + name.str());
+        }
+        return loader->second(b.first, b.second);
+    }
+
+    const char* c;
+    const char* last;
+    std::vector<ident> idents;
+    std::unordered_map<ident, std::function<data_t(const char*, std::size_t)>> loaders;
+};
+
+
+
+
+//=============================================================================
+#ifdef TEST_SERIAL
+#include <algorithm>
+#include <cstdio>
+#include "catch.hpp"
+
+
+
+
+//=============================================================================
+struct snapshot_point
+{
+    double x;
+    double y;
+};
+
+namespace crt {
+    template<> struct type_info<snapshot_point>
+    {
+        static const char* name() { return "snapshot_point"; }
+        static expression to_table(const snapshot_point& p) { return {p.x, p.y}; }
+        static snapshot_point from_expr(const expression& e) { return {double(e.first()), double(e.second())}; }
+
+        static void serialize(const snapshot_point& p, std::string& out)
+        {
+            out.append(reinterpret_cast<const char*>(&p), sizeof(p));
+        }
+
+        static snapshot_point deserialize(const char* data, std::size_t size)
+        {
+            auto p = snapshot_point();
+            std::memcpy(&p, data, std::min(size, sizeof(p)));
+            return p;
+        }
+    };
+}
+
+
+
+
+//=============================================================================
+TEST_CASE("snapshots round-trip expressions and contexts", "[snapshot]")
+{
+    using namespace crt;
+
+    SECTION("expressions of every serializable type")
+    {
+        auto e = parse("(a=1 b=-2.5 c='str' d=sym (e=1 2 3) -2147483647 2147483647)");
+        auto w = snapshot_writer();
+        w.write(e);
+        w.write(expression(-1));
+
+        auto r = snapshot_reader(w.str().data(), w.str().data() + w.str().size());
+        REQUIRE(r.read_expression() == e);
+        REQUIRE(r.read_expression() == expression(-1));
+        REQUIRE(r.at_end());
+        REQUIRE_THROWS_AS(r.read_expression(), snapshot_error);
+    }
+    SECTION("contexts keep their DAG edges")
+    {
+        auto c = context::parse("(A=(B C) B=(C D) C=D D=1)");
+        auto w = snapshot_writer();
+        w.write(c);
+
+        auto r = snapshot_reader(w.str().data(), w.str().data() + w.str().size());
+        auto d = r.read_context();
+        REQUIRE(d == c);
+        REQUIRE(d.get_outgoing("C") == c.get_outgoing("C"));
+        REQUIRE(d.get_incoming("A") == c.get_incoming("A"));
+        REQUIRE(d.sorted_keys().size() == 4);
+    }
+    SECTION("user_data uses the type_info hook, and functions are rejected")
+    {
+        auto w = snapshot_writer();
+        w.write(expression(make_data(snapshot_point{1.5, 2.5})).keyed("p"));
+        REQUIRE_THROWS_AS(w.write(expression([] (expression e) { return e; })), snapshot_error);
+
+        auto r = snapshot_reader(w.str().data(), w.str().data() + w.str().size());
+        REQUIRE_THROWS_AS(snapshot_reader(r).read_expression(), snapshot_error);
+
+        auto p = r.add_type<snapshot_point>().read_expression();
+        REQUIRE(p.key() == "p");
+        REQUIRE(p.check_data<snapshot_point>().y == 2.5);
+    }
+    SECTION("a failed write leaves the writer as it was")
+    {
+        auto f = expression([] (expression e) { return e; });
+        auto w = snapshot_writer();
+        REQUIRE_THROWS_AS(w.write(f.keyed("f")), snapshot_error);
+        REQUIRE_THROWS_AS(w.write(expression({expression(1).keyed("k"), f})), snapshot_error);
+        REQUIRE(w.str().size() == snapshot_writer().str().size());
+
+        w.write(expression(5).keyed("g"));
+        auto r = snapshot_reader(w.str().data(), w.str().data() + w.str().size());
+        REQUIRE(r.read_expression() == expression(5).keyed("g"));
+    }
+    SECTION("functions in a context are left out or substituted")
+    {
+        auto c = context::parse("(a=1 b=(add a 1))").insert(expression([] (expression e) { return e; }).keyed("add"));
+        auto w = snapshot_writer();
+        REQUIRE_THROWS_AS(w.write(c), snapshot_error);
+        w.write(c, nullptr);
+        w.write(c, [] (const expression&) { return expression("native"); });
+
+        auto r = snapshot_reader(w.str().data(), w.str().data() + w.str().size());
+        REQUIRE(r.read_context() == c.erase("add"));
+        REQUIRE(r.read_context().at("add") == expression("native").keyed("add"));
+        REQUIRE(r.at_end());
+    }
+    SECTION("nesting is limited to max_depth")
+    {
+        auto nested = [] (std::size_t depth)
+        {
+            auto bytes = snapshot_writer().str();
+
+            for (std::size_t i = 0; i < depth; ++i)
+            {
+                bytes += char(data_type::table);
+                bytes += char(1);
+            }
+            return bytes + char(data_type::i32) + char(2);
+        };
+        auto ok = nested(snapshot_reader::max_depth);
+        auto r = snapshot_reader(ok.data(), ok.data() + ok.size());
+        REQUIRE(r.read_expression().has_type(data_type::table));
+        REQUIRE(r.at_end());
+        REQUIRE_THROWS_AS(snapshot_reader(ok.data(), ok.data() + ok.size() - 1).read_expression(), snapshot_error);
+
+        auto deep = nested(1000000);
+        REQUIRE_THROWS_AS(snapshot_reader(deep.data(), deep.data() + deep.size()).read_expression(), snapshot_error);
+    }
+    SECTION("snapshots load from a mapped file")
+    {
+        auto w = snapshot_writer();
+        w.write(context::parse("(a=1 b=a)"));
+        w.save("crt-serial-test.crtb");
+        {
+            auto file = mapped_file("crt-serial-test.crtb");
+            auto r = snapshot_reader(file.begin(), file.end());
+            REQUIRE(r.read_context().get_outgoing("a").count("b"));
+        }
+        std::remove("crt-serial-test.crtb");
+    }
+}
+
+#endif // TEST_SERIAL
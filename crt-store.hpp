@@ -0,0 +1,333 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "crt-expr.hpp"
+#include "crt-context.hpp"
+#include "crt-algorithm.hpp"
+
+
+
+
+//=============================================================================
+namespace crt {
+    class product_store;
+    inline std::size_t approximate_size(const expression& e);
+}
+
+
+
+
+//=============================================================================
+/**
+ * Return the approximate number of bytes held by an expression: its own
+ * size, plus its string, user_data (by user_data::size_bytes), or parts.
+ * Shared sub-expressions are counted each time they appear.
+ */
+std::size_t crt::approximate_size(const expression& e)
+{
+    auto bytes = sizeof(expression);
+
+    switch (e.dtype())
+    {
+        case data_type::str   : bytes += e.get_str().size(); break;
+        case data_type::data  : bytes += e.get_data() ? e.get_data()->size_bytes() : 0; break;
+        case data_type::table :
+            for (const auto& part : e)
+            {
+                bytes += approximate_size(*part);
+            }
+            break;
+        default: break;
+    }
+    return bytes;
+}
+
+
+
+
+//=============================================================================
+/**
+ * Holds the products of a context within a memory budget, resolving them
+ * on demand. get(key) resolves the rule and whatever it needs upstream that
+ * is not resident, and then, if the resident products are over budget,
+ * evicts some of them; an evicted product is recomputed through the DAG if
+ * it is asked for again. Products are evicted in this order:
+ *
+ * - products whose downstream rules all have products, so that nothing
+ *   resident needs them any more
+ * - of the rest, those with the most bytes per second of evaluation time
+ *   (large and cheap to recompute first), breaking ties by least recent use
+ *
+ * and never the product being returned, products that are pinned, or the
+ * base products (typically functions) given to the constructor. Sizes are
+ * estimated with approximate_size. The store is safe to share between
+ * threads, but get holds a lock while it resolves.
+ */
+class crt::product_store
+{
+public:
+
+
+    //=========================================================================
+    product_store(context rules, std::size_t budget, context base={})
+    : rules(std::move(rules))
+    , prods(std::move(base))
+    , budget(budget)
+    {
+    }
+
+    product_store(const product_store&) = delete;
+    product_store& operator=(const product_store&) = delete;
+
+
+    /**
+     * Return the product of the rule with the given key, resolving it if it
+     * is not resident, or an empty expression with that key if it cannot be
+     * resolved.
+     */
+    template<typename CallAdapter=call_adapter>
+    expression get(ident key, const CallAdapter& adapter=CallAdapter())
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for (const auto& k : rules.sorted_keys(upstream_of(rules, {key}, prods)))
+        {
+            auto start = std::chrono::steady_clock::now();
+            prods = resolve_only(rules.at(k), std::move(prods), adapter);
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            if (prods.count(k))
+            {
+                num_recomputed += costs.count(k);
+                costs[k] = seconds;
+                entries[k] = {approximate_size(prods.at(k)), 0};
+                resident += entries[k].bytes;
+            }
+        }
+
+        auto e = entries.find(key);
+
+        if (e != entries.end())
+        {
+            e->second.last_use = ++clock;
+        }
+
+        auto result = prods.get(key);
+        evict(key);
+        return result;
+    }
+
+
+    /**
+     * Replace or add a rule, dropping its product and the products of every
+     * rule downstream of it.
+     */
+    void insert(expression rule)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto stale = rules.referencing(rule.key()).insert(rule.key());
+        rules = std::move(rules).insert(std::move(rule));
+
+        for (const auto& k : stale)
+        {
+            drop(k);
+        }
+    }
+
+
+    /**
+     * Keep the product of the given rule resident once it is resolved, for
+     * example while it is on screen.
+     */
+    void pin(ident key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pinned.insert(key);
+    }
+
+    void unpin(ident key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pinned.erase(key);
+        evict(ident());
+    }
+
+
+    /**
+     * Return the resident products, including the base products.
+     */
+    context products() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return prods;
+    }
+
+    std::size_t resident_bytes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return resident;
+    }
+
+    std::size_t evictions() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_evicted;
+    }
+
+    std::size_t recomputations() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_recomputed;
+    }
+
+
+private:
+    //=========================================================================
+    struct entry_t
+    {
+        std::size_t bytes;
+        std::uint64_t last_use;
+    };
+
+
+    void drop(ident key)
+    {
+        auto e = entries.find(key);
+
+        if (e != entries.end())
+        {
+            resident -= e->second.bytes;
+            prods = std::move(prods).erase(key);
+            entries.erase(e);
+        }
+    }
+
+
+    /**
+     * Evict products, other than keep and the pinned ones, until the
+     * resident products are within the budget.
+     */
+    void evict(ident keep)
+    {
+        if (resident <= budget)
+        {
+            return;
+        }
+
+        using rank_t = std::tuple<bool, double, std::uint64_t, ident>;
+        auto candidates = std::vector<rank_t>();
+
+        for (const auto& e : entries)
+        {
+            if (e.first == keep || pinned.count(e.first))
+            {
+                continue;
+            }
+
+            auto needed = false;
+
+            for (const auto& k : rules.get_outgoing(e.first))
+            {
+                needed = needed || ! prods.count(k);
+            }
+            auto per_second = e.second.bytes / (costs.at(e.first) + 1e-9);
+            candidates.emplace_back(needed, -per_second, e.second.last_use, e.first);
+        }
+        std::sort(candidates.begin(), candidates.end(), [] (const rank_t& a, const rank_t& b)
+        {
+            return std::make_tuple(std::get<0>(a), std::get<1>(a), std::get<2>(a))
+                 < std::make_tuple(std::get<0>(b), std::get<1>(b), std::get<2>(b));
+        });
+
+        for (const auto& c : candidates)
+        {
+            if (resident <= budget)
+            {
+                break;
+            }
+            drop(std::get<3>(c));
+            ++num_evicted;
+        }
+    }
+
+    context rules;
+    context prods;
+    std::size_t budget;
+    std::size_t resident = 0;
+    std::size_t num_evicted = 0;
+    std::size_t num_recomputed = 0;
+    std::uint64_t clock = 0;
+    std::unordered_map<ident, entry_t> entries;
+    std::unordered_map<ident, double> costs;
+    std::unordered_set<ident> pinned;
+    mutable std::mutex mutex;
+};
+
+
+
+
+//=============================================================================
+#ifdef TEST_STORE
+#include "catch.hpp"
+#include "crt-array.hpp"
+
+
+
+
+//=============================================================================
+TEST_CASE("product_store evicts within its budget and recomputes", "[store]")
+{
+    using namespace crt;
+
+    auto calls = std::make_shared<int>(0);
+    auto fill = [calls] (expression e)
+    {
+        ++*calls;
+        return expression(make_data(f64_array(std::vector<double>(e.first().get_i32(), 1.0))));
+    };
+    auto total = [calls] (expression e)
+    {
+        ++*calls;
+        return expression(e.first().check_data<f64_array>().size() * 1.0);
+    };
+    auto base = context()
+    .insert(expression(func_t(fill)).keyed("fill"))
+    .insert(expression(func_t(total)).keyed("total"));
+    auto rules = context::parse("(a=(fill 1000) b=(fill 1000) x=(total a) y=(total b))");
+
+    REQUIRE(approximate_size(rules.at("a")) > approximate_size(expression()));
+    REQUIRE(approximate_size(expression(make_data(f64_array(std::vector<double>(1000))))) >= 8000);
+    REQUIRE(approximate_size(expression(data_t())) == sizeof(expression));
+
+    product_store store(rules, 5000, base);
+
+    REQUIRE(store.get("x").get_f64() == 1000.0);
+    REQUIRE(*calls == 2);
+    REQUIRE(store.evictions() == 1);
+    REQUIRE(store.products().count("a") == 0); // nothing needs it any more
+    REQUIRE(store.products().count("x") == 1);
+
+    store.pin("b");
+    REQUIRE(store.get("y").get_f64() == 1000.0);
+    REQUIRE(store.products().count("b") == 1);
+    REQUIRE(store.resident_bytes() > 5000);
+    store.unpin("b");
+    REQUIRE(store.products().count("b") == 0);
+    REQUIRE(store.resident_bytes() <= 5000);
+
+    REQUIRE(store.get("a").check_data<f64_array>().size() == 1000);
+    REQUIRE(store.recomputations() == 1);
+    REQUIRE(*calls == 5);
+
+    store.insert(parse("(fill 10)").keyed("a"));
+    REQUIRE(store.products().count("x") == 0);
+    REQUIRE(store.get("x").get_f64() == 10.0);
+}
+
+#endif // TEST_STORE
@@ -1,7 +1,15 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <vector>
 #include <mutex>
+#include <queue>
 #include <thread>
+#include <unordered_map>
 #include "crt-expr.hpp"
 
 
@@ -10,6 +18,7 @@
 //=============================================================================
 namespace crt {
     class worker_pool;
+    class stealing_pool;
 }
 
 
@@ -25,6 +34,11 @@ public:
     using run_t = std::function<product_t(const std::atomic<bool>* status)>;
 
 
+    /**
+     * Receives task events. Calls are made from the worker threads, but never
+     * while the pool's lock is held, so a listener may call back into the
+     * pool. A task canceled before it started is reported with worker = -1.
+     */
     class listener_t
     {
     public:
@@ -36,7 +50,11 @@ public:
 
     struct task_t
     {
-        task_t(std::string name, run_t run) : name(name), run(run)
+        task_t(std::string name, run_t run, int priority=0, std::size_t sequence=0)
+        : name(name)
+        , run(run)
+        , priority(priority)
+        , sequence(sequence)
         {
             canceled = std::make_shared<std::atomic<bool>>(false);
         }
@@ -45,6 +63,8 @@ public:
         std::string name;
         std::shared_ptr<std::atomic<bool>> canceled;
         run_t run = nullptr;
+        int priority = 0;
+        std::size_t sequence = 0;
     };
 
 
@@ -67,7 +87,10 @@ public:
     {
         if (! stop)
         {
-            stop = true;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
             condition.notify_all();
 
             for (auto& thread : threads)
@@ -78,49 +101,86 @@ public:
     }
 
 
-    void enqueue(std::string name, run_t task)
+    /**
+     * Submit a task with the given name, canceling any task already
+     * submitted under that name. Pending tasks are started in order of
+     * decreasing priority, and in submission order among equal priorities.
+     * The task is built before the pool's lock is taken, and the lock is
+     * taken once.
+     */
+    void enqueue(std::string name, run_t task, int priority=0)
     {
-        cancel(name);
-
-        std::lock_guard<std::mutex> lock(mutex);
-        pending_tasks.push_back({name, task});
+        auto t = task_t(name, std::move(task), priority);
+        auto canceled = std::string();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            canceled = cancel_locked(name);
+            t.sequence = ++sequence;
+            queue.push({priority, t.sequence, name});
+            pending.emplace(name, std::move(t));
+            purge_queue();
+        }
         condition.notify_one();
+        notify_canceled(canceled);
     }
 
 
     bool is_running(std::string name)
     {
         std::lock_guard<std::mutex> lock(mutex);
-        return named(name, running_tasks) != running_tasks.end();
+        return running.count(name) != 0;
     }
 
 
     bool is_pending(std::string name)
     {
         std::lock_guard<std::mutex> lock(mutex);
-        return named(name, pending_tasks) != pending_tasks.end();
+        return pending.count(name) != 0;
     }
 
 
     bool is_submitted(std::string name)
     {
-        return is_running(name) || is_pending(name);
+        std::lock_guard<std::mutex> lock(mutex);
+        return running.count(name) || pending.count(name);
     }
 
 
+    /**
+     * Cancel the task with the given name. A pending task is removed without
+     * running. A running task has its status flag raised; it is up to the
+     * task to poll the flag and return early. Its result is reported to the
+     * listener as canceled.
+     */
     void cancel(std::string name)
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        auto running = named(name, running_tasks);
-        auto pending = named(name, pending_tasks);
+        notify_canceled(cancel_silently(name));
+    }
+
 
-        if (running != running_tasks.end())
+    /**
+     * Cancel every pending and running task.
+     */
+    void cancel_all()
+    {
+        auto canceled = std::vector<std::string>();
         {
-            *running->canceled = true;
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for (auto& task : running)
+            {
+                *task.second.canceled = true;
+            }
+            for (auto& task : pending)
+            {
+                canceled.push_back(task.first);
+            }
+            pending.clear();
+            queue = decltype(queue)();
         }
-        else if (pending != pending_tasks.end())
+        for (const auto& name : canceled)
         {
-            pending_tasks.erase(pending);
+            notify_canceled(name);
         }
     }
 
@@ -128,12 +188,81 @@ public:
 private:
 
 
+    //=========================================================================
+    struct entry_t
+    {
+        int priority;
+        std::size_t sequence;
+        std::string name;
+
+        bool operator<(const entry_t& other) const
+        {
+            return priority != other.priority
+            ? priority < other.priority
+            : sequence > other.sequence;
+        }
+    };
+
+
     /**
-     * Convenience method to find a task with the given name.
+     * Rebuild the queue from the pending tasks if entries for removed tasks
+     * (which are otherwise skipped when popped) make up most of it. Must be
+     * called with the lock held. The check is O(1), and a rebuild, which is
+     * linear in the pending tasks, follows at least pending.size() + 64
+     * removals, so its cost is amortized O(1) per removal.
      */
-    std::vector<task_t>::iterator named(std::string name, std::vector<task_t>& v)
+    void purge_queue()
     {
-        return std::find_if(v.begin(), v.end(), [name] (auto& t) { return t.name == name; });
+        if (queue.size() <= 2 * pending.size() + 64)
+        {
+            return;
+        }
+
+        auto entries = std::vector<entry_t>();
+
+        for (const auto& task : pending)
+        {
+            entries.push_back({task.second.priority, task.second.sequence, task.first});
+        }
+        queue = decltype(queue)(std::less<entry_t>(), std::move(entries));
+    }
+
+
+    /**
+     * Cancel a task, returning the task name if it was pending (and thus
+     * needs a task_canceled event), or an empty string otherwise. Entries
+     * for removed tasks stay in the queue until they are popped or purged.
+     */
+    std::string cancel_silently(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto canceled = cancel_locked(name);
+        purge_queue();
+        return canceled;
+    }
+
+    std::string cancel_locked(const std::string& name)
+    {
+        auto r = running.equal_range(name);
+
+        for (auto task = r.first; task != r.second; ++task)
+        {
+            *task->second.canceled = true;
+        }
+        if (pending.erase(name))
+        {
+            return name;
+        }
+        return std::string();
+    }
+
+
+    void notify_canceled(const std::string& name)
+    {
+        if (listener && ! name.empty())
+        {
+            listener->task_canceled(-1, name);
+        }
     }
 
 
@@ -145,17 +274,32 @@ private:
      */
     task_t next(int id)
     {
-        std::unique_lock<std::mutex> lock(mutex);
-        condition.wait(lock, [this] { return stop || ! pending_tasks.empty(); });
-
-        if (pending_tasks.empty())
+        auto task = task_t(std::string(), nullptr);
         {
-            return {std::string(), nullptr};
-        }
+            std::unique_lock<std::mutex> lock(mutex);
 
-        auto task = pending_tasks.front();
-        pending_tasks.erase(pending_tasks.begin());
-        running_tasks.push_back(task);
+            while (true)
+            {
+                condition.wait(lock, [this] { return stop || ! pending.empty(); });
+
+                if (pending.empty())
+                {
+                    return task;
+                }
+
+                auto top = queue.top();
+                queue.pop();
+                auto p = pending.find(top.name);
+
+                if (p != pending.end() && p->second.sequence == top.sequence)
+                {
+                    task = std::move(p->second);
+                    pending.erase(p);
+                    running.emplace(task.name, task);
+                    break;
+                }
+            }
+        }
 
         if (listener)
         {
@@ -168,24 +312,33 @@ private:
     /**
      * Called by other threads to indicate they have finished a task.
      */
-    void complete(std::string name, int id, product_t result)
+    void complete(const task_t& task, int id, product_t result)
     {
-        std::lock_guard<std::mutex> lock(mutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto r = running.equal_range(task.name);
 
-        auto task = named(name, running_tasks);
+            for (auto t = r.first; t != r.second; ++t)
+            {
+                if (t->second.sequence == task.sequence)
+                {
+                    running.erase(t);
+                    break;
+                }
+            }
+        }
 
         if (listener)
         {
-            if (*task->canceled)
+            if (*task.canceled)
             {
-                listener->task_canceled(id, name);
+                listener->task_canceled(id, task.name);
             }
             else
             {
-                listener->task_finished(id, name, result);
+                listener->task_finished(id, task.name, result);
             }
         }
-        running_tasks.erase(task);
     }
 
 
@@ -198,17 +351,515 @@ private:
         {
             while (auto task = next(id))
             {
-                complete(task.name, id, task.run(task.canceled.get()));
+                complete(task, id, task.run(task.canceled.get()));
             }
         });
     }
 
 
     std::vector<std::thread> threads;
-    std::vector<task_t> pending_tasks;
-    std::vector<task_t> running_tasks;
+    std::priority_queue<entry_t> queue;
+    std::unordered_map<std::string, task_t> pending;
+    std::unordered_multimap<std::string, task_t> running;
+    std::size_t sequence = 0;
     std::condition_variable condition;
     std::atomic<bool> stop = {false};
     std::mutex mutex;
     listener_t* listener = nullptr;
 };
+
+
+
+
+//=============================================================================
+/**
+ * A work-stealing alternative to worker_pool, with the same interface. Each
+ * worker owns a deque of tasks: it takes its newest task first, and when its
+ * own deque is empty it steals the oldest task from another worker. Tasks
+ * enqueued from one of this pool's workers (for example, by a task that is
+ * running) go onto that worker's own deque; other submissions are spread
+ * round-robin. There is no shared queue, so workers only contend when they
+ * steal, or when the pool is idle.
+ *
+ * The priority argument to enqueue is accepted for compatibility but not
+ * used: task order is the work-stealing order described above. The count of
+ * queued jobs is raised before a job is pushed and lowered after it is
+ * popped, so it is never less than the number of jobs in the deques.
+ */
+class crt::stealing_pool
+{
+public:
+
+
+    using product_t = worker_pool::product_t;
+    using run_t = worker_pool::run_t;
+    using listener_t = worker_pool::listener_t;
+
+
+    stealing_pool(int num_workers=4, listener_t* listener=nullptr)
+    : queues(std::max(num_workers, 1))
+    , listener(listener)
+    {
+        for (int n = 0; n < num_workers; ++n)
+        {
+            threads.push_back(make_worker(n));
+        }
+    }
+
+
+    ~stealing_pool()
+    {
+        stop_all();
+    }
+
+
+    void stop_all()
+    {
+        if (! stop)
+        {
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+                stop = true;
+            }
+            sleep_condition.notify_all();
+
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+        }
+    }
+
+
+    void enqueue(std::string name, run_t task, int /*priority*/=0)
+    {
+        auto job = std::make_shared<job_t>(name, task);
+        auto replaced = std::shared_ptr<job_t>();
+
+        {
+            auto& shard = shard_for(name);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto& entry = shard.jobs[name];
+            replaced = entry;
+            entry = job;
+        }
+        notify_canceled(cancel_job(replaced));
+
+        auto& here = current();
+        auto& queue = queues[here.pool == this
+            ? here.worker
+            : next_queue++ % queues.size()];
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            ++queued;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.jobs.push_back(job);
+        }
+        sleep_condition.notify_one();
+    }
+
+
+    bool is_running(std::string name)
+    {
+        auto job = find(name);
+        return job && job->state == job_t::running;
+    }
+
+
+    bool is_pending(std::string name)
+    {
+        auto job = find(name);
+        return job && job->state == job_t::pending;
+    }
+
+
+    bool is_submitted(std::string name)
+    {
+        return find(name) != nullptr;
+    }
+
+
+    void cancel(std::string name)
+    {
+        auto job = std::shared_ptr<job_t>();
+        {
+            auto& shard = shard_for(name);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto j = shard.jobs.find(name);
+
+            if (j != shard.jobs.end())
+            {
+                job = j->second;
+                shard.jobs.erase(j);
+            }
+        }
+        notify_canceled(cancel_job(job));
+    }
+
+
+    void cancel_all()
+    {
+        auto jobs = std::vector<std::shared_ptr<job_t>>();
+
+        for (auto& shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            for (auto& job : shard.jobs)
+            {
+                jobs.push_back(job.second);
+            }
+            shard.jobs.clear();
+        }
+        for (auto& job : jobs)
+        {
+            notify_canceled(cancel_job(job));
+        }
+    }
+
+
+private:
+
+
+    //=========================================================================
+    struct job_t
+    {
+        enum state_t { pending, running, finished };
+
+        job_t(std::string name, run_t run) : name(name), run(run) {}
+        std::string name;
+        run_t run;
+        std::atomic<bool> canceled = {false};
+        std::atomic<int> state = {pending};
+    };
+
+    struct queue_t
+    {
+        std::mutex mutex;
+        std::deque<std::shared_ptr<job_t>> jobs;
+    };
+
+    struct shard_t
+    {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<job_t>> jobs;
+    };
+
+    struct worker_id_t
+    {
+        stealing_pool* pool = nullptr;
+        int worker = -1;
+    };
+
+
+    /**
+     * Return the pool and worker index of the calling thread.
+     */
+    static worker_id_t& current()
+    {
+        static thread_local worker_id_t id;
+        return id;
+    }
+
+
+    shard_t& shard_for(const std::string& name)
+    {
+        return shards[std::hash<std::string>()(name) % shards.size()];
+    }
+
+
+    std::shared_ptr<job_t> find(const std::string& name)
+    {
+        auto& shard = shard_for(name);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto j = shard.jobs.find(name);
+        return j == shard.jobs.end() ? nullptr : j->second;
+    }
+
+
+    /**
+     * Flag a job as canceled. Returns its name if this claimed it before a
+     * worker started it (so it needs a task_canceled event now), or an empty
+     * string otherwise, in which case the worker reports it when it
+     * finishes. A pending job stays in its deque, and is discarded when it
+     * is popped.
+     */
+    std::string cancel_job(const std::shared_ptr<job_t>& job)
+    {
+        if (job)
+        {
+            int expected = job_t::pending;
+            job->canceled = true;
+
+            if (job->state.compare_exchange_strong(expected, job_t::finished))
+            {
+                return job->name;
+            }
+        }
+        return std::string();
+    }
+
+
+    void notify_canceled(const std::string& name)
+    {
+        if (listener && ! name.empty())
+        {
+            listener->task_canceled(-1, name);
+        }
+    }
+
+
+    /**
+     * Pop the newest job from this worker's deque, or else steal the oldest
+     * from another worker's. Returns nullptr if every deque is empty.
+     */
+    std::shared_ptr<job_t> take(int id)
+    {
+        for (std::size_t n = 0; n < queues.size(); ++n)
+        {
+            auto& queue = queues[(id + n) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+
+            if (! queue.jobs.empty())
+            {
+                auto job = std::shared_ptr<job_t>();
+
+                if (n == 0)
+                {
+                    job = std::move(queue.jobs.back());
+                    queue.jobs.pop_back();
+                }
+                else
+                {
+                    job = std::move(queue.jobs.front());
+                    queue.jobs.pop_front();
+                }
+                --queued;
+                return job;
+            }
+        }
+        return nullptr;
+    }
+
+
+    /**
+     * Called by other threads to await the next job that has not been
+     * canceled. Returns nullptr when the pool is shutting down and there is
+     * no more work.
+     */
+    std::shared_ptr<job_t> next(int id)
+    {
+        while (true)
+        {
+            if (auto job = take(id))
+            {
+                int expected = job_t::pending;
+
+                if (! job->canceled && job->state.compare_exchange_strong(expected, job_t::running))
+                {
+                    return job;
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleep_condition.wait(lock, [this] { return stop || queued > 0; });
+
+            if (stop && queued == 0)
+            {
+                return nullptr;
+            }
+        }
+    }
+
+
+    void complete(const std::shared_ptr<job_t>& job, int id, product_t result)
+    {
+        job->state = job_t::finished;
+        {
+            auto& shard = shard_for(job->name);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto j = shard.jobs.find(job->name);
+
+            if (j != shard.jobs.end() && j->second == job)
+            {
+                shard.jobs.erase(j);
+            }
+        }
+
+        if (listener)
+        {
+            if (job->canceled)
+            {
+                listener->task_canceled(id, job->name);
+            }
+            else
+            {
+                listener->task_finished(id, job->name, result);
+            }
+        }
+    }
+
+
+    std::thread make_worker(int id)
+    {
+        return std::thread([this, id] ()
+        {
+            current() = {this, id};
+
+            while (auto job = next(id))
+            {
+                if (listener)
+                {
+                    listener->task_starting(id, job->name);
+                }
+                complete(job, id, job->run(&job->canceled));
+            }
+        });
+    }
+
+
+    std::vector<std::thread> threads;
+    std::vector<queue_t> queues;
+    std::array<shard_t, 16> shards;
+    std::atomic<std::size_t> next_queue = {0};
+    std::atomic<std::size_t> queued = {0};
+    std::condition_variable sleep_condition;
+    std::mutex sleep_mutex;
+    std::atomic<bool> stop = {false};
+    listener_t* listener = nullptr;
+};
+
+
+
+
+//=============================================================================
+#ifdef TEST_WORKERS
+#include "catch.hpp"
+using namespace crt;
+
+
+
+
+//=============================================================================
+TEST_CASE("worker_pool runs tasks by priority and cancels them by name", "[workers]")
+{
+    struct recorder : worker_pool::listener_t
+    {
+        void task_starting(int, std::string) override {}
+        void task_canceled(int, std::string name) override { record("~" + name); }
+        void task_finished(int, std::string name, expression) override { record(name); }
+        void record(std::string name)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            names.push_back(name);
+        }
+        std::vector<std::string> names;
+        std::mutex mutex;
+    };
+
+    auto gate = std::make_shared<std::atomic<bool>>(false);
+    auto wait = [gate] (const std::atomic<bool>* canceled)
+    {
+        while (! *gate && ! *canceled)
+        {
+            std::this_thread::yield();
+        }
+        return expression();
+    };
+    auto noop = [] (const std::atomic<bool>*) { return expression(); };
+
+    recorder r;
+    {
+        worker_pool pool(1, &r);
+        pool.enqueue("block", wait);
+
+        while (! pool.is_running("block"))
+        {
+            std::this_thread::yield();
+        }
+        pool.enqueue("low", noop, 0);
+        pool.enqueue("high", noop, 2);
+        pool.enqueue("mid", noop, 1);
+        pool.enqueue("gone", noop, 3);
+        pool.cancel("gone");
+
+        for (int i = 0; i < 1000; ++i)
+        {
+            pool.enqueue("mid", noop, 1);
+        }
+
+        REQUIRE(pool.is_pending("low"));
+        REQUIRE_FALSE(pool.is_submitted("gone"));
+        *gate = true;
+    }
+    REQUIRE(std::count(r.names.begin(), r.names.end(), "~mid") == 1000);
+    r.names.erase(std::remove(r.names.begin(), r.names.end(), "~mid"), r.names.end());
+    REQUIRE(r.names == std::vector<std::string>{"~gone", "block", "high", "mid", "low"});
+}
+
+
+
+
+
+
+
+TEST_CASE("stealing_pool runs every task, including ones spawned by tasks", "[workers]")
+{
+    auto count = std::make_shared<std::atomic<int>>(0);
+    {
+        stealing_pool pool(4);
+
+        for (int i = 0; i < 64; ++i)
+        {
+            auto name = std::to_string(i);
+
+            pool.enqueue(name, [&pool, count, name] (const std::atomic<bool>*)
+            {
+                pool.enqueue(name + "-child", [count] (const std::atomic<bool>*)
+                {
+                    ++*count;
+                    return expression();
+                });
+                ++*count;
+                return expression();
+            });
+        }
+    }
+    REQUIRE(*count == 128);
+}
+
+
+
+
+TEST_CASE("stealing_pool reports each replaced task exactly once", "[workers]")
+{
+    struct counter : stealing_pool::listener_t
+    {
+        void task_starting(int, std::string) override {}
+        void task_canceled(int worker, std::string) override { ++(worker < 0 ? unstarted : canceled); }
+        void task_finished(int, std::string, expression) override { ++finished; }
+        std::atomic<int> unstarted = {0};
+        std::atomic<int> canceled = {0};
+        std::atomic<int> finished = {0};
+    };
+
+    auto runs = std::make_shared<std::atomic<int>>(0);
+    counter c;
+    {
+        stealing_pool pool(4, &c);
+
+        for (int i = 0; i < 2000; ++i)
+        {
+            pool.enqueue("x", [runs] (const std::atomic<bool>*) { ++*runs; return expression(); });
+        }
+    }
+    REQUIRE(c.unstarted + c.canceled + c.finished == 2000);
+    REQUIRE(c.canceled + c.finished == *runs);
+}
+
+
+
+#endif // TEST_WORKERS
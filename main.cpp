@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include <queue>
 #include <rxcpp/rx.hpp>
@@ -6,6 +7,7 @@
 #include "crt-expr.hpp"
 #include "crt-context.hpp"
 #include "crt-algorithm.hpp"
+#include "crt-io.hpp"
 
 
 
@@ -47,9 +49,14 @@ struct State
     static State load(std::string fname)
     {
         auto state = State();
-        auto ifs = std::ifstream(fname);
-        auto ser = std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
-        state.rules = crt::context::parse(ser);
+
+        if (! std::ifstream(fname))
+        {
+            return state;
+        }
+
+        auto file = crt::mapped_file(fname);
+        state.rules = crt::context::parse(file.begin(), file.end());
         return state;
     }
 
@@ -219,11 +226,17 @@ private:
     {
         wborder(win, 0, 0, 0, 0, 0, 0, 0, 0);
 
+        auto line = std::string();
+        auto product_width = std::size_t(std::max(getmaxx(win) - 81, 0));
+        auto visible_rows = std::max(getmaxy(win) - 2, 1);
+        auto first_row = std::max(state.selected_kernel_row - visible_rows + 1, 0);
         int row = 0;
 
-        for (const auto& item : state.rules)
+        for (const auto& key : state.rules.keys(first_row, visible_rows))
         {
-            if (state.selected_kernel_row == row)
+            const auto& rule = state.rules.at(key);
+
+            if (state.selected_kernel_row == first_row + row)
             {
                 if (state.focus_component == COMPONENT_LIST)
                     wattron(win, COLOR_PAIR(PAIR_SELECTED_FOCUS));
@@ -232,29 +245,33 @@ private:
             }
 
             wmove(win, row + 1, 1);
-            wprintw(win, "%-20s", item.first.data());
+            wprintw(win, "%-20s", key.str().data());
 
             wattroff(win, COLOR_PAIR(PAIR_SELECTED_FOCUS));
             wattroff(win, COLOR_PAIR(PAIR_SELECTED));
 
+            line.clear();
+            rule.keyed("").unparse(line, 52);
             wmove(win, row + 1, 24);
-            wprintw(win, "%s", item.second.keyed("").unparse().data());
+            wprintw(win, "%s", line.data());
 
             wmove(win, row + 1, 80);
+            line.clear();
 
-            try {
-                wprintw(win, "%s", state.products.at(item.first).keyed("").unparse().data());
+            if (state.products.count(key))
+            {
+                state.products.at(key).keyed("").unparse(line, product_width);
+            }
+            else if (state.products_prev.count(key))
+            {
+                state.products_prev.at(key).keyed("").unparse(line, product_width);
+                line += " <pending>";
             }
-            catch (const std::out_of_range& e)
+            else
             {
-                try {
-                    wprintw(win, "%s", (state.products_prev.at(item.first).keyed("").unparse() + " <pending>").data());
-                }
-                catch (const std::out_of_range& e)
-                {
-                    wprintw(win, "%s", "<not cached>");                
-                }
+                line = "<not cached>";
             }
+            wprintw(win, "%s", line.data());
             ++row;
         }
     }
@@ -499,6 +516,7 @@ int main()
     single_item_queue<State> state_queue;
     auto screen = Screen();
     auto state = resolve_products(State::load("out.crt"));
+    crt::worker_pool pool(4);
 
 
     // Declare the event bus
@@ -511,9 +529,9 @@ int main()
     // Declare event pipelines
     //=========================================================================
     auto state_stream = event_stream.scan(state, main_reducer);
-    auto prods_stream = state_stream.map([] (auto state)
+    auto prods_stream = state_stream.map([&pool] (auto state)
     {
-        return observable<>::create<crt::context>(crt::resolution_of(state.rules, state.products, 300))
+        return observable<>::create<crt::context>(crt::products_of(state.rules, state.products, pool))
         .subscribe_on(observe_on_event_loop())
         .concat(observable<>::just(crt::context()));
     })
@@ -1,4 +1,28 @@
 #define TEST_EXPRESSION
 #define TEST_CONTEXT
+#define TEST_ALGORITHM
+#define TEST_WORKERS
+#define TEST_IO
+#define TEST_SERIAL
+#define TEST_PROFILER
+#define TEST_ARRAY
+#define TEST_DISTRIBUTED
+#define TEST_NATIVE
+#define TEST_STORE
+#define TEST_CACHE
+#define TEST_PARALLEL
+#define TEST_PUBLISH
 #include "crt-expr.hpp"
 #include "crt-context.hpp"
+#include "crt-algorithm.hpp"
+#include "crt-workers.hpp"
+#include "crt-io.hpp"
+#include "crt-serial.hpp"
+#include "crt-profiler.hpp"
+#include "crt-array.hpp"
+#include "crt-distributed.hpp"
+#include "crt-native.hpp"
+#include "crt-store.hpp"
+#include "crt-cache.hpp"
+#include "crt-parallel.hpp"
+#include "crt-publish.hpp"